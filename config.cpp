@@ -28,7 +28,7 @@ extern "C" {
 #include "tool.h"
 }
 #include "debug.h"
-#include "wisol.h"
+#include "counters.h"
 #include <EEPROM.h>
 
 ConfigClass configService;
@@ -44,8 +44,10 @@ void ConfigClass::setDefaultConfig() {
   config.firmwareVersion = FIRMWARE_VERSION;
 
   // Project specific configuration
-  config.sigfoxId = wisolService.getSigfoxIdWithRetry(3);
+  config.sigfoxId = 0;                              // set by setSigfoxId() once the Wisol is ready
   config.logConfig = CONFIG_LOGGEUR;
+  config.scanProfile = WIFISCAN_PROFILE;
+  config.traceScans = 0;
 
   // -- end of project specific code
   config.crc32 = calculateCRC32((uint8_t*) &config, sizeof(t_config));
@@ -62,31 +64,81 @@ void ConfigClass::printConfig() {
   // Project specific configuration
   TTRACE((" SigfoxId : %08X\r\n",config.sigfoxId));
   TTRACE((" logConfig : %04X\r\n",config.logConfig));
+  TTRACE((" scanProfile : %d\r\n",config.scanProfile));
+  TTRACE((" traceScans : %d\r\n",config.traceScans));
 
 }
 
 
+/**
+ * Update the sigfoxId read from the Wisol module, the config is stored
+ * only when changed. Invalid Id (0) is ignored.
+ */
+void ConfigClass::setSigfoxId(uint32_t id) {
+  if ( id != 0 && id != config.sigfoxId ) {
+    config.sigfoxId = id;
+    config.crc32 = 0;
+    config.crc32 = calculateCRC32((uint8_t*) &config, sizeof(t_config));
+    storeConfig();
+  }
+}
+
+/**
+ * Change the WiFi scan profile, applied from the next wake-up
+ */
+void ConfigClass::setScanProfile(uint8_t profile) {
+  if ( profile < WIFISCAN_PROFILES && profile != config.scanProfile ) {
+    config.scanProfile = profile;
+    config.crc32 = 0;
+    config.crc32 = calculateCRC32((uint8_t*) &config, sizeof(t_config));
+    storeConfig();
+  }
+}
+
+/**
+ * Enable or disable the scan trace recording, applied from the next wake-up
+ */
+void ConfigClass::setTraceScans(uint8_t trace) {
+  if ( trace != config.traceScans ) {
+    config.traceScans = trace;
+    config.crc32 = 0;
+    config.crc32 = calculateCRC32((uint8_t*) &config, sizeof(t_config));
+    storeConfig();
+  }
+}
+
 /**
  * Force Init the device config 
- * return true if the default config has been flashed. 
+ * return true if the default config has been set.
+ * With deferStore the default config is only flashed by the next storeConfig()
+ * or commit() : the Sigfox Id is set just after, this saves a flash erase.
  * Rq : No trace - at this point the trace configuration is not activated.
  */
-bool ConfigClass::init(bool forceReset) {
+bool ConfigClass::init(bool forceReset, bool deferStore) {
   // Try to load the config from EEPROM
   if ( ! loadConfig() || forceReset ) {
     // Flash the default configuration
     TTRACE1(("Flash the default configuration\r\n"));
     setDefaultConfig();
-    storeConfig(); 
+    if ( deferStore ) pendingStore = true;
+    else storeConfig(); 
     return true;   
   }
   return false;
 }
 
+/**
+ * Flash the default config when its store has been deferred and not done since
+ */
+void ConfigClass::commit() {
+  if ( pendingStore ) storeConfig();
+}
+
 /**
  * Store the config struture into the EEPROM
  */
 void ConfigClass::storeConfig() {
+   pendingStore = false;
    EEPROM.begin(EPROM_MAX_SZ);
    EEPROM.put(0,config);
    EEPROM.commit();
@@ -119,6 +171,7 @@ bool ConfigClass::loadConfig() {
   } else {
     TTRACE1(("Config Load Error - Magic\r\n"));      
   }
+  countersService.inc(COUNTER_CONFIG_LOAD);
   return false;
 }
 
@@ -37,12 +37,69 @@
 // Scheduling
 //#define SCHEDULER_PERIOD_MS (30*1000)            
 #define SCHEDULER_PERIOD_MS (15*60*1000)            // 15 minutes scan and transmission
+//#define SCHEDULER_PERIOD_MS (4*60*60*1000)        // 4 hours - parked assets, uses sleep chaining
+#define TRACKR_BATCH_SCANS  1                       // scans per transmission : 1 - one uplink per scan
+                                                    // 2..4 - the previous scans are batched in a multi-fix
+                                                    // frame sent after the Atlas frame of the last scan
+#define TRACKR_WAKE_BUDGET_MS  28000                // awake time limit of a wake-up, under the 32s watchdog set in setup()
 
+// -------------------------------------------------
+// WiFi scan profiles
+#define WIFISCAN_PROFILE_DEFAULT  0                 // SDK default active scan
+#define WIFISCAN_PROFILE_FAST     1                 // active scan with short dwell time
+#define WIFISCAN_PROFILE_PASSIVE  2                 // passive scan only - regulatory safe
+#define WIFISCAN_PROFILE_HYBRID   3                 // fast active first pass then passive passes
+#define WIFISCAN_PROFILES         4
+#define WIFISCAN_PROFILE          WIFISCAN_PROFILE_DEFAULT  // profile of the default configuration
+
+// -------------------------------------------------
+// Sigfox subscription
+#define QUOTA_DAILY_UPLINKS  140                    // uplinks per day of the subscription
+
+// -------------------------------------------------
+// Sleep chaining
+#define LOWPOWER_MAX_SLEEP_MS  (60*60*1000)         // Longest single deep sleep - hardware limit is ~71 minutes, keep a margin
+
+// -------------------------------------------------
+// RF calibration policy
+#define LOWPOWER_RFCAL_EVERY         24             // Full RF calibration every N scheduled wake-ups
+#define LOWPOWER_RFCAL_SENSE_EVERY    4             // Temperature & voltage check every N wake-ups
+#define LOWPOWER_RFCAL_TEMP_DELTA    50             // Recalibrate on 5.0 C temperature change
+#define LOWPOWER_RFCAL_VOLT_DELTA   100             // Recalibrate on 100 mV voltage change
+
+// -------------------------------------------------
+// Energy model - rough current estimations used for reporting
+#define ENERGY_DEEPSLEEP_UA       20                // ESP deep sleep + Wisol sleep mode
+#define ENERGY_CPU_UA          15000                // ESP awake with RF off
+#define ENERGY_LIGHTSLEEP_UA     900                // ESP in forced light sleep
+#define ENERGY_CHAIN_WAKE_UA   ENERGY_CPU_UA        // ESP awake with RF disabled
+#define ENERGY_CHAIN_WAKE_MS     120                // ROM boot + setup() until back to deep sleep
+#define ENERGY_WIFI_UA         70000                // ESP awake with RF on, scanning
+#define ENERGY_WISOL_TX_UA     45000                // Wisol transmitting (ESP in light sleep not included)
+#define ENERGY_SCAN_MS          2200                // default scan duration, before any measure
+#define ENERGY_UPLINK_MS        6500                // uplink duration, TX and wait for the response
+#define ENERGY_AWAKE_MS          900                // CPU time of a wake-up without the scan
+#define BATTERY_CAPACITY_MAH    2000
+#define BATTERY_USABLE_PCT        80                // capacity derating - self discharge, cut-off voltage
+
+
+// -------------------------------------------------
+// Wisol transport
+#define WISOL_TRANSPORT_SWSERIAL  0                 // SoftwareSerial on WISOL_RX_PIN / WISOL_TX_PIN
+#define WISOL_TRANSPORT_HWSERIAL  1                 // UART0 swapped on D7 (RX) / D8 (TX) - debug on Serial1
+#define WISOL_TRANSPORT_EMULATOR  2                 // In memory module emulator with fault injection, no module
+#define WISOL_TRANSPORT           WISOL_TRANSPORT_SWSERIAL
 
 // -------------------------------------------------
 // Trace & Debug
 #define DEBUG 3
+#if WISOL_TRANSPORT == WISOL_TRANSPORT_HWSERIAL
+#define CONFIG_LOGGEUR  0xF0F0      // all level in file and Serial1 - Serial is used by the Wisol
+#define DEBUG_SERIAL    Serial1
+#else
 #define CONFIG_LOGGEUR  0xF0FF      // all level in file and Serial
+#define DEBUG_SERIAL    Serial
+#endif
 
 // -------------------------------------------------
 // HARDWARE PINOUT
@@ -70,6 +127,8 @@ typedef struct s_config {
         uint8_t   firmwareVersion;
         uint16_t  logConfig;          // see logger.cpp to get the format
         uint32_t  sigfoxId;
+        uint8_t   scanProfile;        // WIFISCAN_PROFILE_xx
+        uint8_t   traceScans;         // 1 - record the scan passes in the trace file
       
 } t_config;
 
@@ -77,14 +136,19 @@ class ConfigClass {
 public:
      t_config config;
 
-     bool init(bool forceReset);
+     bool init(bool forceReset, bool deferStore);
      bool defaultConfig();
      bool loadConfig();
      void storeConfig();
+     void commit();
      void printConfig();
+     void setSigfoxId(uint32_t id);
+     void setScanProfile(uint8_t profile);
+     void setTraceScans(uint8_t trace);
      
 protected:
     void setDefaultConfig();
+    bool pendingStore = false;          // default config not stored yet, see init()
 
  
 };
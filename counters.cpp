@@ -0,0 +1,108 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Operational counters
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+#include <FS.h>
+#include "counters.h"
+#include "logger.h"
+#include "rtc_memory.h"
+
+CountersClass countersService;
+
+static const char * counterNames[COUNTERS] = {
+  "rtc crc", "config load", "wisol timeout", "wisol error", "empty scan", "send ko", "uplink drop", "quota refused"
+};
+
+/**
+ * Restore the counters from RTC memory or from the last flash checkpoint
+ * after a cold boot. The increments done before are kept.
+ */
+void CountersClass::restore() {
+  if ( restored ) return;
+  uint16_t early[COUNTERS];
+  memcpy(early,counters.values,sizeof(early));
+  if ( ! rtcMemoryService.attach(RTC_SLOT_COUNTERS, COUNTERS_VERSION, &counters, sizeof(t_counters)) ) {
+    memset(&counters,0,sizeof(t_counters));
+    loadCheckpoint();
+  }
+  for ( int i = 0 ; i < COUNTERS ; i++ ) {
+    uint32_t v = (uint32_t)counters.values[i] + early[i];
+    counters.values[i] = ( v > 0xFFFF )?0xFFFF:v;
+  }
+  restored = true;
+  rtcMemoryService.setDirty(RTC_SLOT_COUNTERS);
+}
+
+void CountersClass::inc(uint8_t id) {
+  if ( id < COUNTERS && counters.values[id] < 0xFFFF ) counters.values[id]++;
+}
+
+uint16_t CountersClass::get(uint8_t id) {
+  return ( id < COUNTERS )?counters.values[id]:0;
+}
+
+/**
+ * Called once per wake-up, writes the checkpoint every COUNTERS_CHECKPOINT_WAKES
+ */
+void CountersClass::tick() {
+  if ( ++counters.wakes >= COUNTERS_CHECKPOINT_WAKES ) checkpoint();
+}
+
+/**
+ * Save the counters in flash, the file is rewritten in place
+ */
+void CountersClass::checkpoint() {
+  counters.wakes = 0;
+  if ( ! SPIFFS.begin() ) return;
+  File f = SPIFFS.open(COUNTERS_FILE, "w");
+  if ( f ) {
+    uint8_t version = COUNTERS_VERSION;
+    f.write(&version,1);
+    f.write((uint8_t *)counters.values,sizeof(counters.values));
+    f.close();
+    if ( counters.checkpoints < 0xFFFF ) counters.checkpoints++;
+  }
+}
+
+void CountersClass::printCounters() {
+  for ( int i = 0 ; i < COUNTERS ; i++ ) {
+    _log.any("Counter %-14s : %d\r\n",counterNames[i],counters.values[i]);
+  }
+  _log.any("Counters checkpoint in %d wake-ups, %d written\r\n",COUNTERS_CHECKPOINT_WAKES - counters.wakes,counters.checkpoints);
+}
+
+// ==========================================================================
+// Internal functions
+
+bool CountersClass::loadCheckpoint() {
+  if ( ! SPIFFS.begin() ) return false;
+  File f = SPIFFS.open(COUNTERS_FILE, "r");
+  if ( ! f ) return false;
+  uint8_t version = 0;
+  bool ok = ( f.size() == 1 + sizeof(counters.values) && f.read(&version,1) == 1 && version == COUNTERS_VERSION
+              && f.read((uint8_t *)counters.values,sizeof(counters.values)) == sizeof(counters.values) );
+  f.close();
+  if ( ! ok ) memset(counters.values,0,sizeof(counters.values));
+  _log.info("Counters %s from flash\r\n",(ok)?"restored":"not restored");
+  return ok;
+}
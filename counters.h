@@ -0,0 +1,75 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Operational counters
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ * Saturating 16 bits counters of the errors and retries, kept in RTC
+ * memory and checkpointed in flash every COUNTERS_CHECKPOINT_WAKES so
+ * they survive a power loss. They are reported in the counters frame
+ * sent with the health frame.
+ * The counters can be incremented before restore(), the increments are
+ * added to the restored values.
+ */
+#ifndef COUNTERS_H_
+#define COUNTERS_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+#define COUNTERS_VERSION            1         // RTC slot version of t_counters
+#define COUNTERS_FILE               "/counters.bin"
+#define COUNTERS_CHECKPOINT_WAKES   96        // a day with a 15 minutes period
+
+#define COUNTER_RTC_CRC             0         // RTC slots lost
+#define COUNTER_CONFIG_LOAD         1         // config not loaded from EEPROM
+#define COUNTER_WISOL_TIMEOUT       2         // Wisol command without response
+#define COUNTER_WISOL_ERROR         3         // Wisol ERROR: response
+#define COUNTER_SCAN_EMPTY          4         // WiFi scan without AP
+#define COUNTER_SEND_KO             5         // uplink not transmitted
+#define COUNTER_UPLINK_DROP         6         // queued uplink dropped
+#define COUNTER_QUOTA_REFUSED       7         // frame refused by the quota
+#define COUNTERS                    8
+
+typedef struct s_counters {
+      uint16_t  values[COUNTERS];
+      uint16_t  wakes;                  // wake-ups since the last checkpoint
+      uint16_t  checkpoints;            // checkpoints written since power on
+} t_counters;
+
+class CountersClass {
+public:
+  void restore();
+  void inc(uint8_t id);
+  uint16_t get(uint8_t id);
+  void tick();
+  void checkpoint();
+  void printCounters();
+
+protected:
+  t_counters counters;
+  bool restored;
+
+  bool loadCheckpoint();
+};
+
+extern CountersClass countersService;
+
+#endif
@@ -29,32 +29,32 @@
 #include <config.h>
 
 #ifdef DEBUG
-#define TTRACE(x)   Serial.printf x
-#define DTRACE(x)   Serial.printf(x)
+#define TTRACE(x)   DEBUG_SERIAL.printf x
+#define DTRACE(x)   DEBUG_SERIAL.printf(x)
 #else
 #define TTRACE(x)
 #define DTRACE(x)
 #endif
 
 #if DEBUG > 1
-#define TTRACE1(x)  Serial.printf x
+#define TTRACE1(x)  DEBUG_SERIAL.printf x
 #else
 #define TTRACE1(x)
 #endif
 
 #if DEBUG > 2
-#define TTRACE2(x)  Serial.printf x
+#define TTRACE2(x)  DEBUG_SERIAL.printf x
 #else
 #define TTRACE2(x)
 #endif
 
 #if DEBUG > 3
-#define TTRACE3(x)  Serial.printf x
+#define TTRACE3(x)  DEBUG_SERIAL.printf x
 #else
 #define TTRACE3(x)
 #endif
 
-#define FLUSH(x) { Serial.flush(); delay(2); }
+#define FLUSH(x) { DEBUG_SERIAL.flush(); delay(2); }
 
 #define STOP_PIN  D5
 
@@ -0,0 +1,251 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Energy model
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+#include "energy.h"
+#include "logger.h"
+#include "wifiscan.h"
+#include "frame_codec.h"
+#include "tracker.h"
+#include "uplink_queue.h"
+
+EnergyClass energyService;
+
+/**
+ * Pseudo random value in [0,n[, deterministic so the runs can be compared
+ */
+static uint32_t energyRand(uint32_t * seed, uint32_t n) {
+  *seed = *seed * 1103515245 + 12345;
+  return ( *seed >> 16 ) % n;
+}
+
+/**
+ * Print the min, p10, median, p90 and max of the fleet values, in 1/10 when tenth
+ */
+static void energyPrintDist(const char * name, uint16_t * v, bool tenth) {
+  for ( int i = 1 ; i < ENERGY_FLEET_DEVICES ; i++ ) {
+    uint16_t x = v[i];
+    int j = i;
+    while ( j > 0 && v[j-1] > x ) { v[j] = v[j-1]; j--; }
+    v[j] = x;
+  }
+  static const uint8_t pct[] = { 0, 10, 50, 90, 100 };
+  _log.any("| %-13s |",name);
+  for ( int k = 0 ; k < 5 ; k++ ) {
+    uint16_t x = v[ ( pct[k] * (ENERGY_FLEET_DEVICES - 1) ) / 100 ];
+    if ( tenth ) _log.any(" %3d.%d |",x/10,x%10); else _log.any(" %5d |",x);
+  }
+  _log.any("\r\n");
+}
+
+/**
+ * Project the consumption of a wake-up profile over a day and the battery life.
+ * The transmitting wake-ups send the position plus the batched scans frame.
+ * The deep sleep current applies out of the awake phases.
+ */
+void EnergyClass::project(t_energyProfile * p, t_energyProjection * r) {
+  uint32_t wakesPerDay = (24*3600*1000UL) / p->periodMs;
+  uint32_t uplinksPerTx = ( p->batchScans > 1 )?2:1;
+  uint32_t uplinksPerDay = ( wakesPerDay * uplinksPerTx ) / p->batchScans;
+  if ( uplinksPerDay > QUOTA_DAILY_UPLINKS ) uplinksPerDay = QUOTA_DAILY_UPLINKS;
+
+  uint32_t chainWakes = wakesPerDay * ((p->periodMs - 1) / LOWPOWER_MAX_SLEEP_MS);
+  uint64_t awakeMs = (uint64_t)(p->scanMs + p->awakeMs) * wakesPerDay
+                   + (uint64_t)p->uplinkMs * uplinksPerDay
+                   + (uint64_t)ENERGY_CHAIN_WAKE_MS * chainWakes;
+  uint64_t sleepMs = ( awakeMs < 24*3600*1000ULL )?24*3600*1000ULL - awakeMs:0;
+
+  uint64_t wake = ENERGY_NAH(ENERGY_WIFI_UA,p->scanMs) + ENERGY_NAH(ENERGY_CPU_UA,p->awakeMs);
+  uint64_t day  = wake * wakesPerDay
+                + ENERGY_NAH(ENERGY_WISOL_TX_UA,p->uplinkMs) * uplinksPerDay
+                + ENERGY_NAH(ENERGY_DEEPSLEEP_UA,sleepMs)
+                + ENERGY_NAH(ENERGY_CHAIN_WAKE_UA,ENERGY_CHAIN_WAKE_MS) * chainWakes;
+
+  r->wakeNAh = day / wakesPerDay;
+  r->dayUAh = day / 1000;
+  r->uplinksPerDay = uplinksPerDay;
+  uint64_t usableUAh = (uint64_t)BATTERY_CAPACITY_MAH * 10 * BATTERY_USABLE_PCT;
+  uint64_t days = ( r->dayUAh > 0 )?usableUAh / r->dayUAh:0xFFFF;
+  r->days = ( days > 0xFFFF )?0xFFFF:days;
+}
+
+/**
+ * Print the projection of the current configuration and of other periods,
+ * with the durations of measuredProfile(). The last line is the battery life
+ * from the charge estimated since power on.
+ */
+void EnergyClass::printProjection() {
+  static const uint32_t periods[] = { 5*60*1000UL, 15*60*1000UL, 60*60*1000UL, 4*60*60*1000UL };
+  static const uint8_t batches[] = { 1, FRAME_MULTIFIX_MAX+1 };
+  const int rows = 2 * sizeof(periods)/sizeof(periods[0]);
+  t_energyProfile p;
+  t_energyProjection r;
+  measuredProfile(&p);
+  t_state * s = &trackrService.state;
+  _log.any("Battery %d mAh, scan %d ms, awake %d ms, uplink %d ms\r\n",BATTERY_CAPACITY_MAH,p.scanMs,p.awakeMs,p.uplinkMs);
+  _log.any("+-----------+-------+----------+----------+---------+------+\r\n");
+  _log.any("| period  s | batch | wake nAh | day  uAh | uplinks | days |\r\n");
+  _log.any("+-----------+-------+----------+----------+---------+------+\r\n");
+  for ( int i = 0 ; i <= rows ; i++ ) {
+    // last line is the current configuration
+    p.periodMs = ( i < rows )?periods[i/2]:SCHEDULER_PERIOD_MS;
+    p.batchScans = ( i < rows )?batches[i%2]:TRACKR_BATCH_SCANS;
+    project(&p,&r);
+    _log.any("|%c%9d | %5d | %8d | %8d | %7d | %4d |\r\n",(i < rows)?' ':'*',p.periodMs/1000,p.batchScans,r.wakeNAh,r.dayUAh,r.uplinksPerDay,r.days);
+  }
+  _log.any("+-----------+-------+----------+----------+---------+------+\r\n");
+  if ( s->wakes > 0 && s->totalMs >= 1000 ) {
+    uint32_t dayUAh = (uint32_t)( (s->chargeNAh * 24*3600ULL / (s->totalMs / 1000)) / 1000 );
+    uint64_t usableUAh = (uint64_t)BATTERY_CAPACITY_MAH * 10 * BATTERY_USABLE_PCT;
+    _log.any("Measured : %d wake-ups, %d ms awake avg, %d uAh/day, %d days\r\n",s->wakes,s->awakeMs/s->wakes,dayUAh,
+              (dayUAh > 0)?(uint32_t)(usableUAh/dayUAh):0xFFFF);
+  }
+}
+
+/**
+ * Simulate a virtual device over ENERGY_FLEET_DAYS or until its battery is empty.
+ * Every wake-up scans for a randomized duration, the fix comes from the replayed
+ * trace scans (or fixPct without trace). The transmitting wake-ups send the fresh
+ * frames then retry the queued ones once an uplink went through, as the uplink
+ * queue does, each uplink failing with the device loss rate. The daily quota
+ * caps the transmissions.
+ */
+void EnergyClass::simulate(t_energyProfile * p, t_fleetDevice * d, uint8_t * apCounts, uint16_t scans, uint8_t fixPct) {
+  uint32_t wakesPerDay = (24*3600*1000UL) / p->periodMs;
+  uint32_t chainWakes = (p->periodMs - 1) / LOWPOWER_MAX_SLEEP_MS;
+  uint8_t  fresh = ( p->batchScans > 1 )?2:1;
+  uint64_t capacityNAh = (uint64_t)d->capacityUAh * 1000;
+  uint64_t baseNAh = ENERGY_NAH(ENERGY_CPU_UA,p->awakeMs) + ENERGY_NAH(ENERGY_CHAIN_WAKE_UA,ENERGY_CHAIN_WAKE_MS) * chainWakes;
+
+  for ( uint16_t day = 0 ; day < ENERGY_FLEET_DAYS ; day++ ) {
+    uint16_t dayUplinks = 0;
+    for ( uint32_t w = 0 ; w < wakesPerDay ; w++ ) {
+      uint32_t scanMs = ( p->scanMs * (100 - ENERGY_FLEET_SCAN_PCT + energyRand(&d->seed,2*ENERGY_FLEET_SCAN_PCT+1)) ) / 100;
+      uint32_t awakeMs = scanMs + p->awakeMs + chainWakes * ENERGY_CHAIN_WAKE_MS;
+      d->chargeNAh += ENERGY_NAH(ENERGY_WIFI_UA,scanMs) + baseNAh;
+      bool fix = ( scans > 0 )?( apCounts[d->tracePos++ % scans] >= 2 ):( energyRand(&d->seed,100) < fixPct );
+      if ( fix ) d->batchFixes++;
+
+      if ( (w+1) % p->batchScans == 0 ) {
+        bool delivered = false;
+        for ( uint8_t f = 0 ; f < fresh + UPLINK_RETRY_PER_WAKE ; f++ ) {
+          bool retry = ( f >= fresh );
+          if ( retry && ( ! delivered || d->queued == 0 ) ) break;
+          if ( dayUplinks >= QUOTA_DAILY_UPLINKS ) break;
+          dayUplinks++;
+          d->uplinks++;
+          awakeMs += p->uplinkMs;
+          d->chargeNAh += ENERGY_NAH(ENERGY_WISOL_TX_UA,p->uplinkMs);
+          if ( energyRand(&d->seed,100) < d->lossPct ) {
+            if ( retry ) break;
+            if ( d->queued < UPLINK_QUEUE_SZ ) d->queued++;
+          } else if ( retry ) {
+            d->queued--;
+          } else if ( ! delivered ) {
+            delivered = true;
+            d->positions += d->batchFixes;
+          }
+        }
+        d->batchFixes = 0;
+      }
+
+      uint32_t sleepMs = ( awakeMs < p->periodMs )?p->periodMs - awakeMs:0;
+      d->chargeNAh += ( (uint64_t)d->sleepNA * sleepMs ) / (3600*1000UL);
+      if ( d->chargeNAh >= capacityNAh ) {
+        d->days = ( day > 0 )?day:1;
+        return;
+      }
+    }
+    yield();
+  }
+  uint64_t days = ( capacityNAh * ENERGY_FLEET_DAYS ) / d->chargeNAh;
+  d->days = ( days > 0xFFFF )?0xFFFF:days;
+}
+
+/**
+ * Run the fleet simulation with the current configuration and print the battery
+ * life, uplinks and positions per day distributions over the virtual devices.
+ * The devices differ by their deep sleep current, capacity, uplink loss rate
+ * and starting point in the replayed trace.
+ */
+void EnergyClass::printFleet() {
+  t_energyProfile p;
+  measuredProfile(&p);
+  p.periodMs = SCHEDULER_PERIOD_MS;
+  p.batchScans = TRACKR_BATCH_SCANS;
+  uint8_t apCounts[ENERGY_FLEET_TRACE_SCANS];
+  uint16_t scans = wifiscanService.readTraceApCounts(apCounts,ENERGY_FLEET_TRACE_SCANS);
+  uint8_t fixPct = wifiscanService.getFixPct();
+
+  uint16_t days[ENERGY_FLEET_DEVICES];
+  uint16_t uplinks[ENERGY_FLEET_DEVICES];         // per day, 1/10
+  uint16_t positions[ENERGY_FLEET_DEVICES];       // per day, 1/10
+  uint32_t start = millis();
+  for ( int i = 0 ; i < ENERGY_FLEET_DEVICES ; i++ ) {
+    t_fleetDevice d;
+    memset(&d,0,sizeof(t_fleetDevice));
+    d.seed = 0x1234567 + i * 2654435761UL;
+    d.sleepNA = ENERGY_DEEPSLEEP_UA * 10 * (100 - ENERGY_FLEET_SPREAD_PCT + energyRand(&d.seed,2*ENERGY_FLEET_SPREAD_PCT+1));
+    d.capacityUAh = ( (uint32_t)BATTERY_CAPACITY_MAH * 10 * BATTERY_USABLE_PCT
+                    * (100 - ENERGY_FLEET_SPREAD_PCT + energyRand(&d.seed,2*ENERGY_FLEET_SPREAD_PCT+1)) ) / 100;
+    d.lossPct = energyRand(&d.seed,2*ENERGY_FLEET_LOSS_PCT+1);
+    d.tracePos = ( scans > 0 )?energyRand(&d.seed,scans):0;
+    simulate(&p,&d,apCounts,scans,fixPct);
+    uint32_t simDays = ( d.days < ENERGY_FLEET_DAYS )?d.days:ENERGY_FLEET_DAYS;
+    days[i] = d.days;
+    uplinks[i] = ( d.uplinks * 10 ) / simDays;
+    positions[i] = ( d.positions * 10 ) / simDays;
+  }
+
+  _log.any("Fleet : %d devices over %d days, period %d s, batch %d, scan %d ms, ",ENERGY_FLEET_DEVICES,ENERGY_FLEET_DAYS,p.periodMs/1000,p.batchScans,p.scanMs);
+  if ( scans > 0 ) _log.any("%d trace scans replayed\r\n",scans); else _log.any("no trace, %d%% fixes\r\n",fixPct);
+  _log.any("+---------------+-------+-------+-------+-------+-------+\r\n");
+  _log.any("|               |   min |   p10 |   p50 |   p90 |   max |\r\n");
+  _log.any("+---------------+-------+-------+-------+-------+-------+\r\n");
+  energyPrintDist("life days",days,false);
+  energyPrintDist("uplinks/day",uplinks,true);
+  energyPrintDist("positions/day",positions,true);
+  _log.any("+---------------+-------+-------+-------+-------+-------+\r\n");
+  _log.any("Simulated in %d ms\r\n",millis()-start);
+}
+
+// ==========================================================================
+// Internal functions
+
+/**
+ * Durations of a wake-up : the scan and awake durations are the averages measured
+ * by the device when available, the awake time without the scan and the uplinks
+ * of the current configuration
+ */
+void EnergyClass::measuredProfile(t_energyProfile * p) {
+  p->scanMs = wifiscanService.getAvgScanMs();
+  if ( p->scanMs == 0 ) p->scanMs = ENERGY_SCAN_MS;
+  p->awakeMs = ENERGY_AWAKE_MS;
+  p->uplinkMs = ENERGY_UPLINK_MS;
+  t_state * s = &trackrService.state;
+  if ( s->wakes > 0 ) {
+    uint32_t uplinksMs = ( p->uplinkMs * ((TRACKR_BATCH_SCANS > 1)?2:1) ) / TRACKR_BATCH_SCANS;
+    uint32_t avgMs = s->awakeMs / s->wakes;
+    if ( avgMs > p->scanMs + uplinksMs ) p->awakeMs = avgMs - p->scanMs - uplinksMs;
+  }
+}
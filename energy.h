@@ -0,0 +1,85 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Energy model
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ * Current consumption model per phase (ENERGY_xx in config.h) used to
+ * project the battery life and the uplinks per day of a configuration,
+ * and to simulate a fleet of virtual devices for their distributions.
+ */
+#ifndef ENERGY_H_
+#define ENERGY_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+#define ENERGY_NAH(ua,ms)       ( ((uint64_t)(ua) * (ms)) / 3600 )   // charge in nAh
+
+#define ENERGY_FLEET_DEVICES      32        // virtual devices of the fleet simulation
+#define ENERGY_FLEET_DAYS         365       // simulated time, the battery life is extrapolated beyond
+#define ENERGY_FLEET_SPREAD_PCT   20        // device to device spread of the deep sleep current and of the capacity
+#define ENERGY_FLEET_SCAN_PCT     25        // scan to scan spread of the radio on time
+#define ENERGY_FLEET_LOSS_PCT     10        // mean uplink failure rate, from 0 to twice across the devices
+#define ENERGY_FLEET_TRACE_SCANS  256       // scans of the trace file replayed as WiFi environment
+
+typedef struct s_energyProfile {
+      uint32_t  periodMs;       // wake-up period
+      uint32_t  scanMs;         // radio on time per wake-up
+      uint32_t  awakeMs;        // CPU time per wake-up, scan excluded
+      uint32_t  uplinkMs;       // duration of an uplink
+      uint8_t   batchScans;     // wake-ups per transmission
+} t_energyProfile;
+
+typedef struct s_energyProjection {
+      uint32_t  wakeNAh;        // charge of a wake-up, uplinks averaged
+      uint32_t  dayUAh;         // charge per day
+      uint16_t  uplinksPerDay;  // after the quota
+      uint16_t  days;           // battery life
+} t_energyProjection;
+
+typedef struct s_fleetDevice {
+      uint32_t  seed;           // pseudo random generator
+      uint32_t  sleepNA;        // deep sleep current
+      uint32_t  capacityUAh;    // usable capacity
+      uint8_t   lossPct;        // uplink failure rate
+      uint8_t   queued;         // failed frames waiting for a retry
+      uint8_t   batchFixes;     // scans with a fix waiting for the transmission
+      uint16_t  tracePos;       // next scan of the replayed trace
+      uint16_t  days;           // battery life
+      uint32_t  uplinks;        // transmissions
+      uint32_t  positions;      // delivered scans with a fix
+      uint64_t  chargeNAh;
+} t_fleetDevice;
+
+class EnergyClass {
+public:
+  void project(t_energyProfile * profile, t_energyProjection * result);
+  void printProjection();
+  void simulate(t_energyProfile * profile, t_fleetDevice * device, uint8_t * apCounts, uint16_t scans, uint8_t fixPct);
+  void printFleet();
+
+protected:
+  void measuredProfile(t_energyProfile * profile);
+};
+
+extern EnergyClass energyService;
+
+#endif
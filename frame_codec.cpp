@@ -0,0 +1,291 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Uplink frame codec
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+#include <string.h>
+#include "frame_codec.h"
+#include "logger.h"
+ extern "C" {
+   #include "tool.h"
+ }
+
+FrameCodecClass frameCodec;
+
+static uint32_t frameClamp(int32_t v, int32_t max) {
+  if ( v < 0 ) return 0;
+  if ( v > max ) return max;
+  return v;
+}
+
+/**
+ * Encode the frame in buf (FRAME_MAX_SZ bytes)
+ * Returns the frame size, 0 when the frame is not valid
+ */
+uint8_t FrameCodecClass::encode(t_frame * frame, uint8_t * buf) {
+  uint16_t pos = 0;
+  memset(buf,0,FRAME_MAX_SZ);
+  switch ( frame->type ) {
+    case FRAME_TYPE_ATLAS:
+      memcpy(buf,frame->macs,FRAME_ATLAS_SZ);
+      return FRAME_ATLAS_SZ;
+
+    case FRAME_TYPE_NOFIX: {
+      t_frameNoFix * n = &frame->noFix;
+      dsk_putBits(buf,&pos,FRAME_VERSION,2);
+      dsk_putBits(buf,&pos,FRAME_TYPE_NOFIX,3);
+      dsk_putBits(buf,&pos,(n->voltage == FRAME_INVALID_VOLTAGE)?255:frameClamp(((int32_t)n->voltage-2000)/10,254),8);
+      dsk_putBits(buf,&pos,(n->temperature == FRAME_INVALID_TEMPERATURE)?127:frameClamp(n->temperature/10+40,126),7);
+      dsk_putBits(buf,&pos,frameClamp(n->apCount,63),6);
+      dsk_putBits(buf,&pos,n->wakes,16);
+      dsk_putBits(buf,&pos,n->uplinkFailures & 0x0F,4);
+      dsk_putBits(buf,&pos,frameClamp(n->pending,3),2);
+      dsk_putBits(buf,&pos,frameClamp(n->wisolFailures,7),3);
+      dsk_putBits(buf,&pos,frameClamp(n->rtcErrors,3),2);
+      break;
+    }
+
+    case FRAME_TYPE_MULTIFIX:
+      if ( frame->multiFix.count == 0 || frame->multiFix.count > FRAME_MULTIFIX_MAX ) return 0;
+      dsk_putBits(buf,&pos,FRAME_VERSION,2);
+      dsk_putBits(buf,&pos,FRAME_TYPE_MULTIFIX,3);
+      dsk_putBits(buf,&pos,frame->multiFix.count,2);
+      for ( int i = 0 ; i < frame->multiFix.count ; i++ ) {
+        t_frameFix * f = &frame->multiFix.fixes[i];
+        for ( int k = 0 ; k < 3 ; k++ ) dsk_putBits(buf,&pos,f->nic[k],8);
+        dsk_putBits(buf,&pos,frameClamp((f->rssi - FRAME_RSSI_MIN)/FRAME_RSSI_STEP,7),3);
+      }
+      break;
+
+    case FRAME_TYPE_HEALTH:
+      dsk_putBits(buf,&pos,FRAME_VERSION,2);
+      dsk_putBits(buf,&pos,FRAME_TYPE_HEALTH,3);
+      dsk_putBits(buf,&pos,frame->health.chargeMAh,16);
+      dsk_putBits(buf,&pos,frame->health.wakes,16);
+      dsk_putBits(buf,&pos,frameClamp(frame->health.avgAwakeMs/10,1023),10);
+      dsk_putBits(buf,&pos,(frame->health.voltage == FRAME_INVALID_VOLTAGE)?255:frameClamp(((int32_t)frame->health.voltage-2000)/10,254),8);
+      break;
+
+    case FRAME_TYPE_COUNTERS:
+      dsk_putBits(buf,&pos,FRAME_VERSION,2);
+      dsk_putBits(buf,&pos,FRAME_TYPE_COUNTERS,3);
+      for ( int i = 0 ; i < FRAME_COUNTERS ; i++ ) dsk_putBits(buf,&pos,frameClamp(frame->counters[i],1023),10);
+      break;
+
+    case FRAME_TYPE_PLACE:
+      dsk_putBits(buf,&pos,FRAME_VERSION,2);
+      dsk_putBits(buf,&pos,FRAME_TYPE_PLACE,3);
+      dsk_putBits(buf,&pos,frame->place.key,16);
+      dsk_putBits(buf,&pos,frame->place.heartbeat & 1,1);
+      break;
+
+    default:
+      return 0;
+  }
+  return (pos + 7) / 8;
+}
+
+/**
+ * Decode a received frame, returns false when the frame is not valid
+ */
+bool FrameCodecClass::decode(uint8_t * buf, uint8_t len, t_frame * frame) {
+  uint16_t pos = 0;
+  uint32_t v;
+  memset(frame,0,sizeof(t_frame));
+  if ( len == FRAME_ATLAS_SZ ) {
+    frame->type = FRAME_TYPE_ATLAS;
+    memcpy(frame->macs,buf,FRAME_ATLAS_SZ);
+    return true;
+  }
+  if ( len == 0 || len > FRAME_MAX_SZ ) return false;
+  if ( dsk_getBits(buf,&pos,2) != FRAME_VERSION ) return false;
+  frame->type = dsk_getBits(buf,&pos,3);
+  switch ( frame->type ) {
+    case FRAME_TYPE_NOFIX: {
+      t_frameNoFix * n = &frame->noFix;
+      if ( len < 7 ) return false;
+      v = dsk_getBits(buf,&pos,8);
+      n->voltage = ( v == 255 )?FRAME_INVALID_VOLTAGE:2000 + 10*v;
+      v = dsk_getBits(buf,&pos,7);
+      n->temperature = ( v == 127 )?FRAME_INVALID_TEMPERATURE:((int16_t)v - 40)*10;
+      n->apCount = dsk_getBits(buf,&pos,6);
+      n->wakes = dsk_getBits(buf,&pos,16);
+      n->uplinkFailures = dsk_getBits(buf,&pos,4);
+      n->pending = dsk_getBits(buf,&pos,2);
+      n->wisolFailures = dsk_getBits(buf,&pos,3);
+      n->rtcErrors = dsk_getBits(buf,&pos,2);
+      return true;
+    }
+
+    case FRAME_TYPE_MULTIFIX:
+      frame->multiFix.count = dsk_getBits(buf,&pos,2);
+      if ( frame->multiFix.count == 0 || len < (7 + 27*frame->multiFix.count + 7)/8 ) return false;
+      for ( int i = 0 ; i < frame->multiFix.count ; i++ ) {
+        t_frameFix * f = &frame->multiFix.fixes[i];
+        for ( int k = 0 ; k < 3 ; k++ ) f->nic[k] = dsk_getBits(buf,&pos,8);
+        f->rssi = FRAME_RSSI_MIN + FRAME_RSSI_STEP * dsk_getBits(buf,&pos,3);
+      }
+      return true;
+
+    case FRAME_TYPE_HEALTH:
+      if ( len < 7 ) return false;
+      frame->health.chargeMAh = dsk_getBits(buf,&pos,16);
+      frame->health.wakes = dsk_getBits(buf,&pos,16);
+      frame->health.avgAwakeMs = 10 * dsk_getBits(buf,&pos,10);
+      v = dsk_getBits(buf,&pos,8);
+      frame->health.voltage = ( v == 255 )?FRAME_INVALID_VOLTAGE:2000 + 10*v;
+      return true;
+
+    case FRAME_TYPE_COUNTERS:
+      if ( len < 11 ) return false;
+      for ( int i = 0 ; i < FRAME_COUNTERS ; i++ ) frame->counters[i] = dsk_getBits(buf,&pos,10);
+      return true;
+
+    case FRAME_TYPE_PLACE:
+      if ( len < 3 ) return false;
+      frame->place.key = dsk_getBits(buf,&pos,16);
+      frame->place.heartbeat = dsk_getBits(buf,&pos,1);
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+/**
+ * 16 bits hash of a MAC identifying an AP in the place fingerprints, never 0
+ */
+uint16_t FrameCodecClass::macHash(uint8_t * mac) {
+  uint32_t crc = calculateCRC32(mac,6);
+  uint16_t h = (crc >> 16) ^ (crc & 0xFFFF);
+  return ( h == 0 )?1:h;
+}
+
+/**
+ * Log the frame content
+ */
+void FrameCodecClass::print(t_frame * frame) {
+  switch ( frame->type ) {
+    case FRAME_TYPE_ATLAS: {
+      char macStr[20];
+      dsk_macToString(macStr,frame->macs);
+      _log.info("1. %s\r\n",macStr);
+      dsk_macToString(macStr,&frame->macs[6]);
+      _log.info("2. %s\r\n",macStr);
+      break;
+    }
+    case FRAME_TYPE_NOFIX: {
+      t_frameNoFix * n = &frame->noFix;
+      _log.info("No fix : %dmV %dC %d AP, wake %d, failures uplink %d queue %d wisol %d rtc %d\r\n",
+                n->voltage,n->temperature/10,n->apCount,n->wakes,n->uplinkFailures,n->pending,n->wisolFailures,n->rtcErrors);
+      break;
+    }
+    case FRAME_TYPE_MULTIFIX:
+      for ( int i = 0 ; i < frame->multiFix.count ; i++ ) {
+        t_frameFix * f = &frame->multiFix.fixes[i];
+        _log.info("%d. xx:xx:xx:%02X:%02X:%02X %ddBm\r\n",i+1,f->nic[0],f->nic[1],f->nic[2],f->rssi);
+      }
+      break;
+    case FRAME_TYPE_HEALTH:
+      _log.info("Health : %d mAh, wake %d, awake %d ms avg, %dmV\r\n",frame->health.chargeMAh,frame->health.wakes,frame->health.avgAwakeMs,frame->health.voltage);
+      break;
+    case FRAME_TYPE_COUNTERS:
+      _log.info("Counters : %d %d %d %d %d %d %d %d\r\n",frame->counters[0],frame->counters[1],frame->counters[2],frame->counters[3],
+                frame->counters[4],frame->counters[5],frame->counters[6],frame->counters[7]);
+      break;
+    case FRAME_TYPE_PLACE:
+      _log.info("Place %04X%s\r\n",frame->place.key,(frame->place.heartbeat)?" (heartbeat)":"");
+      break;
+  }
+}
+
+/**
+ * Encode then decode a frame of each type and verify the fields are restored
+ * with the resolution of the encoding.
+ */
+bool FrameCodecClass::selfCheck() {
+  t_frame in, out;
+  uint8_t buf[FRAME_MAX_SZ];
+  uint8_t len;
+  bool ok = true;
+
+  memset(&in,0,sizeof(t_frame));
+  in.type = FRAME_TYPE_ATLAS;
+  for ( int i = 0 ; i < 12 ; i++ ) in.macs[i] = 0x10 + 7*i;
+  len = encode(&in,buf);
+  ok &= ( len == FRAME_ATLAS_SZ && decode(buf,len,&out) && memcmp(&in,&out,sizeof(t_frame)) == 0 );
+
+  memset(&in,0,sizeof(t_frame));
+  in.type = FRAME_TYPE_NOFIX;
+  in.noFix.voltage = 3310;
+  in.noFix.temperature = -120;
+  in.noFix.apCount = 1;
+  in.noFix.wakes = 0xBEEF;
+  in.noFix.uplinkFailures = 9;
+  in.noFix.pending = 2;
+  in.noFix.wisolFailures = 5;
+  in.noFix.rtcErrors = 1;
+  len = encode(&in,buf);
+  ok &= ( len == 7 && decode(buf,len,&out) && memcmp(&in,&out,sizeof(t_frame)) == 0 );
+
+  in.noFix.voltage = FRAME_INVALID_VOLTAGE;
+  in.noFix.temperature = FRAME_INVALID_TEMPERATURE;
+  len = encode(&in,buf);
+  ok &= ( decode(buf,len,&out) && out.noFix.voltage == FRAME_INVALID_VOLTAGE && out.noFix.temperature == FRAME_INVALID_TEMPERATURE );
+
+  memset(&in,0,sizeof(t_frame));
+  in.type = FRAME_TYPE_MULTIFIX;
+  in.multiFix.count = FRAME_MULTIFIX_MAX;
+  for ( int i = 0 ; i < FRAME_MULTIFIX_MAX ; i++ ) {
+    in.multiFix.fixes[i].nic[0] = 0xA0 + i;
+    in.multiFix.fixes[i].nic[1] = 0x5A;
+    in.multiFix.fixes[i].nic[2] = 0xFF - i;
+    in.multiFix.fixes[i].rssi = -90 + 20*i;
+  }
+  len = encode(&in,buf);
+  ok &= ( len == 11 && decode(buf,len,&out) && memcmp(&in,&out,sizeof(t_frame)) == 0 );
+
+  memset(&in,0,sizeof(t_frame));
+  in.type = FRAME_TYPE_HEALTH;
+  in.health.chargeMAh = 1234;
+  in.health.wakes = 4321;
+  in.health.avgAwakeMs = 3450;
+  in.health.voltage = 3020;
+  len = encode(&in,buf);
+  ok &= ( len == 7 && decode(buf,len,&out) && memcmp(&in,&out,sizeof(t_frame)) == 0 );
+
+  memset(&in,0,sizeof(t_frame));
+  in.type = FRAME_TYPE_COUNTERS;
+  for ( int i = 0 ; i < FRAME_COUNTERS ; i++ ) in.counters[i] = 1 + 146*i;
+  len = encode(&in,buf);
+  ok &= ( len == 11 && decode(buf,len,&out) && memcmp(&in,&out,sizeof(t_frame)) == 0 );
+
+  memset(&in,0,sizeof(t_frame));
+  in.type = FRAME_TYPE_PLACE;
+  in.place.key = 0xC35A;
+  in.place.heartbeat = 1;
+  len = encode(&in,buf);
+  ok &= ( len == 3 && decode(buf,len,&out) && memcmp(&in,&out,sizeof(t_frame)) == 0 );
+
+  _log.any("Frame codec self check : %s\r\n",(ok)?"OK":"FAILED");
+  return ok;
+}
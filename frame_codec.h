@@ -0,0 +1,122 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Uplink frame codec
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ * A 12 bytes frame is the raw 2 MACs expected by Sigfox Atlas WiFi.
+ * Shorter frames are bit packed, MSB first, and start with a 2 bits
+ * version and a 3 bits type :
+ *  no-fix    : voltage 8b ((mV-2000)/10, 255 invalid), temperature 7b
+ *              (C+40, 127 invalid), AP count 6b, wake counter 16b,
+ *              uplink failures 4b, queued uplinks 2b, wisol failures 3b,
+ *              RTC errors 2b                                  - 7 bytes
+ *  multi-fix : fix count 2b then per fix the 3 lower MAC bytes 24b and
+ *              the RSSI class 3b ((rssi+100)/10)              - 5 to 11 bytes
+ *              nic 000000 when the scan found no AP. The fixes are the
+ *              previous scans, oldest first, and are resolved against
+ *              the MACs of the surrounding Atlas frames.
+ *  health    : charge consumed 16b (mAh), wake counter 16b, average
+ *              awake time 10b (10 ms, saturated), voltage 8b (as no-fix)
+ *                                                             - 7 bytes
+ *  place     : place key 16b (macHash() of the first MAC of the Atlas
+ *              frame sent when the place was learnt), heartbeat 1b
+ *                                                             - 3 bytes
+ *  counters  : the 8 operational counters (COUNTER_xx order), 10b each
+ *              saturated                                     - 11 bytes
+ * encode() and decode() only rely on the tool.c bit packing so the backend
+ * decoder can reuse them.
+ */
+#ifndef FRAME_CODEC_H_
+#define FRAME_CODEC_H_
+
+#include <stdint.h>
+
+#define FRAME_VERSION               2         // 2 : 3 bits type field (place frame)
+#define FRAME_ATLAS_SZ              12
+#define FRAME_MAX_SZ                12
+
+#define FRAME_TYPE_ATLAS            0         // identified by its size, no header
+#define FRAME_TYPE_NOFIX            1
+#define FRAME_TYPE_MULTIFIX         2
+#define FRAME_TYPE_PLACE            3
+#define FRAME_TYPE_HEALTH           4
+#define FRAME_TYPE_COUNTERS         5
+
+#define FRAME_MULTIFIX_MAX          3
+#define FRAME_COUNTERS              8
+#define FRAME_RSSI_MIN              -100
+#define FRAME_RSSI_STEP             10
+
+#define FRAME_INVALID_TEMPERATURE   -300      // same as WISOL_INVALID_TEMPERATURE
+#define FRAME_INVALID_VOLTAGE       0         // same as WISOL_INVALID_VOLTAGE
+
+typedef struct s_frameNoFix {
+      uint16_t  voltage;        // mV
+      int16_t   temperature;    // 1/10 C, decoded with a 1 C resolution
+      uint8_t   apCount;        // access points found by the scan
+      uint16_t  wakes;          // wake-up counter, wraps
+      uint8_t   uplinkFailures; // failed uplinks, wraps on 4 bits
+      uint8_t   pending;        // uplinks waiting in the queue
+      uint8_t   wisolFailures;  // consecutive Wisol transitions without answer
+      uint8_t   rtcErrors;      // RTC slots lost on the last wake-up
+} t_frameNoFix;
+
+typedef struct s_frameFix {
+      uint8_t   nic[3];         // 3 lower bytes of the MAC
+      int8_t    rssi;
+} t_frameFix;
+
+typedef struct s_frame {
+      uint8_t   type;           // FRAME_TYPE_xx
+      union {
+        uint8_t       macs[12];
+        t_frameNoFix  noFix;
+        struct {
+          uint8_t     count;
+          t_frameFix  fixes[FRAME_MULTIFIX_MAX];
+        } multiFix;
+        struct {
+          uint16_t    chargeMAh;
+          uint16_t    wakes;        // wraps
+          uint16_t    avgAwakeMs;   // decoded with a 10 ms resolution
+          uint16_t    voltage;      // mV
+        } health;
+        uint16_t      counters[FRAME_COUNTERS];
+        struct {
+          uint16_t    key;
+          uint8_t     heartbeat;  // 1 when sent because the device stayed in the place
+        } place;
+      };
+} t_frame;
+
+class FrameCodecClass {
+public:
+  uint8_t encode(t_frame * frame, uint8_t * buf);
+  bool decode(uint8_t * buf, uint8_t len, t_frame * frame);
+  static uint16_t macHash(uint8_t * mac);
+
+  void print(t_frame * frame);
+  bool selfCheck();
+};
+
+extern FrameCodecClass frameCodec;
+
+#endif
@@ -0,0 +1,186 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Known places cache
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+#include "geofence.h"
+#include "wifiscan.h"
+#include "logger.h"
+#include "debug.h"
+#include "rtc_memory.h"
+
+GeofenceClass geofenceService;
+
+/**
+ * Restore the cache from RTC memory, empty after a cold boot
+ */
+void GeofenceClass::restore() {
+  if ( ! rtcMemoryService.attach(RTC_SLOT_GEOFENCE, GEOFENCE_VERSION, &cache, sizeof(t_geofence)) ) {
+    memset(&cache,0,sizeof(t_geofence));
+    cache.current = GEOFENCE_NO_PLACE;
+  }
+  rtcMemoryService.setDirty(RTC_SLOT_GEOFENCE);
+}
+
+/**
+ * Match the last scan with the known places. The Atlas frame given is
+ * replaced by a place frame for a known place, a new place is learnt once
+ * its Atlas frame is delivered (delivered()).
+ * When keepAtlas is set the frame is sent unchanged : the nic of the
+ * multi-fix frames are resolved against the MACs of the Atlas frames.
+ * Returns false when nothing has to be sent : the device is still in the
+ * place of the last transmission.
+ */
+bool GeofenceClass::prepare(t_frame * frame, uint16_t wake, bool keepAtlas) {
+  uint32_t start = micros();
+  uint8_t score;
+  uint8_t p = match(&score);
+  TTRACE2(("Geofence match %d (score %d) in %d us\r\n",p,score,micros()-start));
+
+  unknownPlace = ( p == GEOFENCE_NO_PLACE );
+  if ( p == GEOFENCE_NO_PLACE ) {
+    cache.current = GEOFENCE_NO_PLACE;
+    return true;
+  }
+  cache.places[p].lastUse = wake;
+  if ( ! keepAtlas && p == cache.current && cache.silent < GEOFENCE_HEARTBEAT_WAKES ) {
+    cache.silent++;
+    cache.suppressed++;
+    _log.info("Still in place %04X, no uplink\r\n",cache.places[p].key);
+    return false;
+  }
+  if ( ! keepAtlas ) {
+    frame->type = FRAME_TYPE_PLACE;
+    frame->place.key = cache.places[p].key;
+    frame->place.heartbeat = ( p == cache.current )?1:0;
+  }
+  cache.current = p;
+  cache.silent = 0;
+  return true;
+}
+
+/**
+ * Called once the prepared frame has been transmitted, the place of an
+ * Atlas frame is learnt : the backend knows its key from now.
+ */
+void GeofenceClass::delivered(t_frame * frame, uint16_t wake) {
+  if ( ! unknownPlace ) return;
+  unknownPlace = false;
+  learn(frame,wake);
+}
+
+void GeofenceClass::printPlaces() {
+  _log.any("Places (current %d, %d uplinks saved)\r\n",cache.current,cache.suppressed);
+  for ( int i = 0 ; i < GEOFENCE_PLACES ; i++ ) {
+    t_geofencePlace * p = &cache.places[i];
+    if ( p->key == 0 ) continue;
+    _log.any("%d. %04X used %5d :",i,p->key,p->lastUse);
+    for ( int k = 0 ; k < GEOFENCE_APS ; k++ ) {
+      if ( p->aps[k].hash != 0 ) _log.any(" %04X [%d,%d]",p->aps[k].hash,p->aps[k].rssiMin,p->aps[k].rssiMax);
+    }
+    _log.any("\r\n");
+  }
+}
+
+// ==========================================================================
+// Internal functions
+
+/**
+ * Search the place with the most fingerprint APs found in the scan with an
+ * RSSI in the learnt range. The matching RSSI ranges are widened.
+ */
+uint8_t GeofenceClass::match(uint8_t * score) {
+  uint16_t hashes[WIFISCAN_MAX_AP];
+  int8_t   rssi[WIFISCAN_MAX_AP];
+  uint8_t  n = wifiscanService.getApCount();
+  for ( int i = 0 ; i < n ; i++ ) {
+    t_wifiAp * ap = wifiscanService.getWiFi(i);
+    hashes[i] = FrameCodecClass::macHash(ap->mac);
+    rssi[i] = ap->rssi;
+  }
+
+  uint8_t best = GEOFENCE_NO_PLACE;
+  *score = 0;
+  for ( int p = 0 ; p < GEOFENCE_PLACES ; p++ ) {
+    if ( cache.places[p].key == 0 ) continue;
+    uint8_t s = 0;
+    for ( int k = 0 ; k < GEOFENCE_APS ; k++ ) {
+      t_geofenceAp * a = &cache.places[p].aps[k];
+      if ( a->hash == 0 ) continue;
+      for ( int i = 0 ; i < n ; i++ ) {
+        if ( hashes[i] == a->hash && rssi[i] >= a->rssiMin - GEOFENCE_RSSI_MARGIN && rssi[i] <= a->rssiMax + GEOFENCE_RSSI_MARGIN ) {
+          s++;
+          break;
+        }
+      }
+    }
+    if ( s >= GEOFENCE_MIN_MATCH && s > *score ) {
+      best = p;
+      *score = s;
+    }
+  }
+  if ( best == GEOFENCE_NO_PLACE ) return best;
+
+  for ( int k = 0 ; k < GEOFENCE_APS ; k++ ) {
+    t_geofenceAp * a = &cache.places[best].aps[k];
+    for ( int i = 0 ; i < n ; i++ ) {
+      if ( hashes[i] != a->hash ) continue;
+      if ( rssi[i] < a->rssiMin && a->rssiMax - rssi[i] <= GEOFENCE_RSSI_SPAN ) a->rssiMin = rssi[i];
+      if ( rssi[i] > a->rssiMax && rssi[i] - a->rssiMin <= GEOFENCE_RSSI_SPAN ) a->rssiMax = rssi[i];
+    }
+  }
+  return best;
+}
+
+/**
+ * Store the scan as a new place, replacing the least recently used one
+ */
+void GeofenceClass::learn(t_frame * frame, uint16_t wake) {
+  if ( frame->type != FRAME_TYPE_ATLAS ) return;
+  uint8_t p = 0;
+  for ( int i = 0 ; i < GEOFENCE_PLACES ; i++ ) {
+    if ( cache.places[i].key == 0 ) { p = i; break; }
+    if ( (int16_t)(cache.places[i].lastUse - cache.places[p].lastUse) < 0 ) p = i;
+  }
+  t_geofencePlace * place = &cache.places[p];
+  memset(place,0,sizeof(t_geofencePlace));
+  place->key = FrameCodecClass::macHash(frame->macs);
+  place->lastUse = wake;
+
+  // the APs with the best RSSI form the fingerprint
+  uint8_t n = wifiscanService.getApCount();
+  bool used[WIFISCAN_MAX_AP] = { false };
+  for ( int k = 0 ; k < GEOFENCE_APS && k < n ; k++ ) {
+    int best = -1;
+    for ( int i = 0 ; i < n ; i++ ) {
+      if ( ! used[i] && ( best < 0 || wifiscanService.getWiFi(i)->rssi > wifiscanService.getWiFi(best)->rssi ) ) best = i;
+    }
+    used[best] = true;
+    t_wifiAp * ap = wifiscanService.getWiFi(best);
+    place->aps[k].hash = FrameCodecClass::macHash(ap->mac);
+    place->aps[k].rssiMin = ap->rssi;
+    place->aps[k].rssiMax = ap->rssi;
+  }
+  cache.current = p;
+  cache.silent = 0;
+  _log.info("New place %04X learnt in slot %d\r\n",place->key,p);
+}
@@ -0,0 +1,81 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Known places cache
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ * The places already reported with an Atlas frame are kept in RTC memory
+ * as a fingerprint of the best APs (MAC hash and RSSI range). A revisit
+ * is reported with a short place frame and staying in the same place is
+ * not reported until the heartbeat period expires.
+ */
+#ifndef GEOFENCE_H_
+#define GEOFENCE_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "frame_codec.h"
+
+#define GEOFENCE_VERSION          1         // RTC slot version of t_geofence
+#define GEOFENCE_PLACES           4         // places in the LRU cache
+#define GEOFENCE_APS              3         // APs in a place fingerprint
+#define GEOFENCE_RSSI_MARGIN      8         // dB accepted around the learnt RSSI range
+#define GEOFENCE_RSSI_SPAN        30        // max width of a learnt RSSI range
+#define GEOFENCE_MIN_MATCH        2         // APs of the fingerprint to find for a match
+#define GEOFENCE_HEARTBEAT_WAKES  16        // wake-ups without transmission in the same place
+#define GEOFENCE_NO_PLACE         0xFF
+
+typedef struct s_geofenceAp {
+      uint16_t  hash;           // FrameCodecClass::macHash(), 0 when not used
+      int8_t    rssiMin;
+      int8_t    rssiMax;
+} t_geofenceAp;
+
+typedef struct s_geofencePlace {
+      t_geofenceAp aps[GEOFENCE_APS];
+      uint16_t  key;            // hash of the first MAC of the learning Atlas frame, 0 when free
+      uint16_t  lastUse;        // wake-up counter of the last match, for the LRU
+} t_geofencePlace;
+
+typedef struct s_geofence {
+      t_geofencePlace places[GEOFENCE_PLACES];
+      uint8_t   current;        // place of the last transmission, GEOFENCE_NO_PLACE when unknown
+      uint8_t   silent;         // wake-ups without transmission in the current place
+      uint16_t  suppressed;     // uplinks saved
+} t_geofence;
+
+class GeofenceClass {
+public:
+  void restore();
+  bool prepare(t_frame * frame, uint16_t wake, bool keepAtlas);
+  void delivered(t_frame * frame, uint16_t wake);
+  void printPlaces();
+
+protected:
+  t_geofence cache;
+  bool unknownPlace;            // the last prepared frame is an Atlas frame of a new place
+
+  uint8_t match(uint8_t * score);
+  void learn(t_frame * frame, uint16_t wake);
+};
+
+extern GeofenceClass geofenceService;
+
+#endif
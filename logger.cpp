@@ -50,6 +50,11 @@ LoggerClass _log;
   */
 bool LoggerClass::init(uint16_t config) {
 
+#if WISOL_TRANSPORT == WISOL_TRANSPORT_HWSERIAL
+  // Serial is connected to the Wisol module
+  config &= ~LOGGER_CONFIG_SERIAL_MASK;
+#endif
+
   this->logError = ( config & LOGGER_CONFIG_ERROR_LVL_MASK  ); 
   this->logWarn  = ( config & LOGGER_CONFIG_WARN_LVL_MASK   ); 
   this->logInfo  = ( config & LOGGER_CONFIG_INFO_LVL_MASK   ); 
@@ -127,7 +132,7 @@ uint16_t LoggerClass::close() {
 }
 
 /**
- * Print the log file over the serial line. As this is usually called during the
+ * Print the log file over the debug serial line. As this is usually called during the
  * sleeping loop the SPIFF is supposed to be closed. The function try to manage this and 
  * restore the initial state.
  */
@@ -140,11 +145,11 @@ void LoggerClass::cat() {
   }
   this->logFile = SPIFFS.open("/log.txt", "r");
   if (this->logFile) {
-    Serial.printf("====== Read Log File (%db)=======\n",this->logFile.size());
+    DEBUG_SERIAL.printf("====== Read Log File (%db)=======\n",this->logFile.size());
     while ( this->logFile.available() ) {
-       Serial.print((char)this->logFile.read());
+       DEBUG_SERIAL.print((char)this->logFile.read());
     }
-    Serial.println("====== end of Log File =======\n");    
+    DEBUG_SERIAL.println("====== end of Log File =======\n");    
     this->logFile.close();
   }
   if ( this->ready ) {        
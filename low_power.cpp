@@ -32,43 +32,218 @@ extern "C" {
 #include "config.h"
 #include "debug.h"
 #include "low_power.h"
+#include "rtc_memory.h"
+#include "wisol.h"
 
 
 
 
 LowPowerClass lowPowerService;
 
+/**
+ * Must be called first in setup(), before any Serial / WiFi / config init.
+ * When the wake-up is an intermediate step of a sleep chain (sleep period longer than
+ * what the hardware supports in one shot) the device goes straight back to deep sleep
+ * and this function never returns. Otherwise the normal wake-up sequence continues.
+ */
+void LowPowerClass::chainedWakeUp() {
+  wakeRfMode = LOWPOWER_RF_DEFAULT;
+
+  rst_info * rstInfo = ESP.getResetInfoPtr(); 
+  rtcMemoryService.begin( rstInfo->reason == REASON_DEEP_SLEEP_AWAKE );
+  if ( ! rtcMemoryService.attach(RTC_SLOT_LOWPOWER, LOWPOWER_HEADER_VERSION, &header, sizeof(t_lowPowerHeader)) ) {
+    memset(&header,0,sizeof(t_lowPowerHeader));
+    header.rfMode = LOWPOWER_RF_FULLCAL;
+    measureSleep(false);
+    return;
+  }
+
+  if ( header.remaining > 0 ) {
+    // Intermediate wake-up, nothing to do, go back to sleep asap
+    header.remaining--;
+    header.overheadMs += millis() + ENERGY_CHAIN_WAKE_MS;
+    rtcMemoryService.setDirty(RTC_SLOT_LOWPOWER);
+    rtcMemoryService.commit();
+    ESP.deepSleep( header.chunkMs * 1000L, WAKE_RF_DISABLED );
+  }
+  wakeRfMode = header.rfMode;
+  measureSleep(true);
+}
 
 /**
- * When the device is restarting this function is called at first.
- * In case of reset startup the function just return false.
- * In case of restart after deep sleep the function restore context and return true
- * A byte buffer where to restaure the data is provided as context.
- * In this byte buffer, a specific area contains the location for crc32 to ensure a correct restore.
+ * Return the time in Ms spent awake by the intermediate wake-ups of the last
+ * sleep chain. This time is not included in the scheduled sleep duration.
+ */
+uint32_t LowPowerClass::getChainOverheadMs() {
+  return header.overheadMs;
+}
+
+/**
+ * Return the real time in Ms elapsed since the last deepSleep() call, measured with
+ * the calibrated RTC clock. This includes the intermediate wake-ups and the boot time.
+ * When the measure is not available the requested sleep plus the known overhead is returned.
+ */
+uint32_t LowPowerClass::getLastSleepMs() {
+  if ( lastSleepMs > 0 ) return lastSleepMs;
+  return header.sleepMs + millis() + header.overheadMs;
+}
+
+/**
+ * Return the current RTC oscillator drift estimation in ppm, positive when the
+ * device sleeps longer than requested.
+ */
+int32_t LowPowerClass::getDriftPpm() {
+  return clock.driftPpm;
+}
+
+/**
+ * Measure the real sleep duration from the RTC time counter. The RTC tick period
+ * is calibrated on sleep and on wake-up, the average of both is used.
+ * The drift estimation compares the sleep duration (measure minus the time counted
+ * by millis() since boot) with the duration requested to the hardware, the boot
+ * time before millis() starts is considered as part of the drift.
  */
-bool LowPowerClass::wakeUp(uint8_t * context, uint32_t * crc32area, unsigned int sz) {
+void LowPowerClass::measureSleep(bool restored) {
+  lastSleepMs = 0;
+  bool valid = rtcMemoryService.attach(RTC_SLOT_CLOCK, LOWPOWER_CLOCK_VERSION, &clock, sizeof(t_rtcClock));
+  if ( ! valid ) memset(&clock,0,sizeof(t_rtcClock));
+  if ( ! restored || ! valid || clock.requestedMs == 0 || clock.requestedMs > LOWPOWER_RTC_MAX_MEASURE_MS ) return;
+
+  uint32_t ticks = system_get_rtc_time() - clock.rtcTime;
+  uint64_t cali = ( (uint64_t)clock.cali + system_rtc_clock_cali_proc() ) / 2;
+  uint32_t measuredMs = (uint32_t)( ( ((uint64_t)ticks * cali) >> 12 ) / 1000 );
+  uint32_t awakeMs = millis();
+  if ( measuredMs <= awakeMs ) return;
+
+  int32_t ppm = (int32_t)( ( ((int64_t)(measuredMs - awakeMs) - clock.requestedMs) * 1000000LL ) / clock.requestedMs );
+  if ( ppm > LOWPOWER_DRIFT_MAX_PPM || ppm < -LOWPOWER_DRIFT_MAX_PPM ) return;
+  clock.driftPpm = ( clock.driftPpm == 0 )? ppm : ( 3 * clock.driftPpm + ppm ) / 4;
+  lastSleepMs = measuredMs;
+}
+
+// ==========================================================================
+// RF power policy
 
-  if ( sz > RTC_MAX_SZ ) {
-    TTRACE(("** Invalid context size !\r\n"));
-    while(true);
+/**
+ * Called from RF_PRE_INIT(), before the RF init and before the global objects are
+ * constructed : only the stack and the RTC memory can be used here.
+ * Set the phy power-up calibration level according to the policy decided before sleeping.
+ */
+void LowPowerClass::rfPreInit() {
+  t_lowPowerHeader h;
+  if ( RtcMemoryClass::peek(RTC_SLOT_LOWPOWER, LOWPOWER_HEADER_VERSION, &h, sizeof(t_lowPowerHeader)) && h.remaining == 0 ) {
+    system_phy_set_powerup_option( (h.rfMode == LOWPOWER_RF_NOCAL)?2:3 );    // 2 : VDD33 only (2ms) / 3 : full calibration (200ms)
+  } else {
+    system_phy_set_powerup_option(3);
   }
+}
+
+/**
+ * Called right before the radio is powered up for the scan : the wake-up keeps the
+ * RF disabled through the boot, the calibration level decided by the policy is
+ * applied when the radio starts so its cost is in the scan start latency.
+ */
+void LowPowerClass::rfPowerUp() {
+  system_phy_set_powerup_option( (wakeRfMode == LOWPOWER_RF_NOCAL)?2:3 );      // 2 : VDD33 only (2ms) / 3 : full calibration (200ms)
+}
 
+/**
+ * Indicate if temperature and voltage should be collected on this wake-up to
+ * check the calibration validity. Readings cost some Wisol AT round trip so
+ * this is done only every LOWPOWER_RFCAL_SENSE_EVERY wake-ups.
+ */
+bool LowPowerClass::rfPolicyNeedsSensors() {
+  return ( header.calVoltage == 0 || (header.wakesSinceCal % LOWPOWER_RFCAL_SENSE_EVERY) == 0 );
+}
+
+/**
+ * Decide the RF mode of the next scheduled wake-up. A full calibration is done every
+ * LOWPOWER_RFCAL_EVERY wake-ups or when the temperature or the voltage moved from the
+ * conditions of the last calibration. Otherwise the stored calibration is reused.
+ * Invalid temperature / voltage (no reading) are ignored.
+ */
+void LowPowerClass::rfPolicy(int16_t temperature, uint16_t voltage) {
+  bool fullCal = ( header.wakesSinceCal >= LOWPOWER_RFCAL_EVERY || header.calVoltage == 0 );
+  if ( temperature != WISOL_INVALID_TEMPERATURE && abs(temperature - header.calTemperature) > LOWPOWER_RFCAL_TEMP_DELTA ) fullCal = true;
+  if ( voltage != WISOL_INVALID_VOLTAGE && abs((int)voltage - (int)header.calVoltage) > LOWPOWER_RFCAL_VOLT_DELTA ) fullCal = true;
+
+  if ( fullCal && voltage != WISOL_INVALID_VOLTAGE ) {
+    header.rfMode = LOWPOWER_RF_FULLCAL;
+    header.wakesSinceCal = 0;
+    header.calTemperature = temperature;
+    header.calVoltage = voltage;
+  } else if ( fullCal ) {
+    // no reading to attach to the calibration, do it but keep checking
+    header.rfMode = LOWPOWER_RF_FULLCAL;
+    header.wakesSinceCal = 0;
+  } else {
+    header.rfMode = LOWPOWER_RF_NOCAL;
+    header.wakesSinceCal++;
+  }
+  TTRACE2(("RF policy : next wake-up %s (%d since cal)\r\n",rfModeName(header.rfMode),header.wakesSinceCal));
+}
+
+/**
+ * Record the time needed to get the radio ready for scanning with the RF mode
+ * of the current wake-up.
+ */
+void LowPowerClass::recordScanLatency(uint32_t latencyMs) {
+  int i = rfModeIndex(wakeRfMode);
+  if ( header.latencyCnt[i] < 0xFFFF ) header.latencyCnt[i]++;
+  // running average over the last 16 measures
+  uint16_t n = ( header.latencyCnt[i] < 16 )?header.latencyCnt[i]:16;
+  header.latencyAvgMs[i] = ( header.latencyAvgMs[i] * (n-1) + latencyMs ) / n;
+  TTRACE1(("RF %s : scan start latency %d ms (avg %d ms)\r\n",rfModeName(wakeRfMode),latencyMs,header.latencyAvgMs[i]));
+}
+
+/**
+ * Print the scan start latency per RF mode
+ */
+void LowPowerClass::printRfStats() {
+  const uint8_t modes[LOWPOWER_RF_MODES] = { LOWPOWER_RF_DEFAULT, LOWPOWER_RF_FULLCAL, LOWPOWER_RF_NOCAL };
+  TTRACE(("-------- RF stats --------\r\n"));
+  for ( int i = 0 ; i < LOWPOWER_RF_MODES ; i++ ) {
+    TTRACE((" %-8s : %5d ms avg (%d)\r\n",rfModeName(modes[i]),header.latencyAvgMs[i],header.latencyCnt[i]));
+  }
+  TTRACE((" Wake-ups since cal : %d\r\n",header.wakesSinceCal));
+  TTRACE((" RTC drift : %d ppm\r\n",clock.driftPpm));
+}
+
+int LowPowerClass::rfModeIndex(uint8_t mode) {
+  switch ( mode ) {
+    case LOWPOWER_RF_FULLCAL : return 1;
+    case LOWPOWER_RF_NOCAL :   return 2;
+    default:                   return 0;
+  }
+}
+
+const char * LowPowerClass::rfModeName(uint8_t mode) {
+  switch ( mode ) {
+    case LOWPOWER_RF_FULLCAL :  return "fullcal";
+    case LOWPOWER_RF_NOCAL :    return "nocal";
+    case LOWPOWER_RF_DISABLED : return "disabled";
+    default:                    return "default";
+  }
+}
+
+/**
+ * When the device is restarting this function is called at first.
+ * In case of reset startup the function just return false.
+ * In case of restart after deep sleep the function restore the context from its RTC slot
+ * and return true. When the slot is corrupted the function returns false and the
+ * caller restarts as after a reset; the other RTC slots are not impacted.
+ * The context is attached to its slot in both cases so it is saved on deep sleep.
+ */
+bool LowPowerClass::wakeUp(uint8_t slot, uint8_t version, void * context, unsigned int sz) {
+
+  bool restored = rtcMemoryService.attach(slot, version, context, sz);
   rst_info * rstInfo = ESP.getResetInfoPtr(); 
   if ( rstInfo->reason == REASON_DEEP_SLEEP_AWAKE ) {
     TTRACE1(("Wake Up from deep-sleep\r\n"));
-    // Restoring context from the RTC Memory    
-    if ( ESP.rtcUserMemoryRead(0, (uint32_t*) context, sz) ) {
-      uint32_t crc = *crc32area;
-      *crc32area = 0;
-      if ( crc != calculateCRC32((uint8_t*) context, sz) ) {
-        TTRACE(("CRC32 Error during RTC Context restoration\r\n"));
-        ESP.reset();
-      }    
-    } else {
+    if ( ! restored ) {
       TTRACE(("Error during RTC Context restoration\r\n"));
-      ESP.reset();
     }
-    return true;
+    return restored;
   } else {
     TTRACE1(("Wake-up : Reset detected \r\n"));
     return false;
@@ -80,14 +255,33 @@ bool LowPowerClass::wakeUp(uint8_t * context, uint32_t * crc32area, unsigned int
  * The device is entering in deepSleep Mode for the given time in Ms. After this time
  * the GPIO16 (D0 on D1-mini) will go low. Connected to RST pin it will restart the device
  * During restart the cause will indicate what to do on restart.
- * Context of execution is stored in RTC memory and restore. Max size is 512 Bytes
+ * The dirty RTC slots are saved before sleeping.
+ * The duration is compensated with the RTC drift estimation to get the requested real time.
+ * When the duration is larger than LOWPOWER_MAX_SLEEP_MS the sleep is split in a chain of
+ * equal deep sleeps, the intermediate wake-ups are managed by chainedWakeUp()
  */
-void LowPowerClass::deepSleep(uint32_t durationMs, uint8_t * context, uint32_t * crc32area, unsigned int sz) {
-  *crc32area = 0;
-  *crc32area = calculateCRC32((uint8_t*) context, sz);
-  if ( ! ESP.rtcUserMemoryWrite(0, (uint32_t*) context, sz) ) {
-     TTRACE(("Error when writting RTC Memory\r\n"));
+void LowPowerClass::deepSleep(uint32_t durationMs) {
+  header.sleepMs = durationMs;
+  durationMs = (uint32_t)( ((uint64_t)durationMs * 1000000LL) / (1000000LL + clock.driftPpm) );
+  clock.requestedMs = durationMs;
+  clock.cali = system_rtc_clock_cali_proc();
+  clock.rtcTime = system_get_rtc_time();
+  rtcMemoryService.setDirty(RTC_SLOT_CLOCK);
+
+  uint32_t chunks = ( durationMs + LOWPOWER_MAX_SLEEP_MS - 1 ) / LOWPOWER_MAX_SLEEP_MS;
+  if ( chunks == 0 ) chunks = 1;
+  header.remaining = chunks - 1;
+  header.chunkMs = durationMs / chunks;
+  header.overheadMs = 0;
+  rtcMemoryService.setDirty(RTC_SLOT_LOWPOWER);
+  rtcMemoryService.commit();
+  if ( header.remaining > 0 ) {
+    // charge estimation in nAh for the intermediate wake-ups vs the sleep itself
+    uint32_t wakeNAh  = ( header.remaining * ENERGY_CHAIN_WAKE_UA * ENERGY_CHAIN_WAKE_MS ) / 3600;
+    uint32_t sleepNAh = ( ENERGY_DEEPSLEEP_UA * (durationMs / 1000) * 10 ) / 36;
+    TTRACE1(("Sleep chain : %d x %d ms, %d intermediate wake-ups (%d ms, ~%d nAh) vs sleep ~%d nAh\r\n",
+              chunks, header.chunkMs, header.remaining, header.remaining * ENERGY_CHAIN_WAKE_MS, wakeNAh, sleepNAh ));
   }
-  ESP.deepSleep( durationMs * 1000L, WAKE_RF_DISABLED );
+  // The radio stays off from the boot, the scan powers it up with rfPowerUp()
+  ESP.deepSleep( header.chunkMs * 1000L, WAKE_RF_DISABLED );
 }
-
@@ -27,11 +27,70 @@
 #ifndef LOWPOWER_H_
 #define LOWPOWER_H_
 
+#include <Arduino.h>
+
+#define LOWPOWER_HEADER_VERSION 2             // RTC slot version of the low power header
+
+// RF calibration applied when the scan powers the radio up, values are the one of system_deep_sleep_set_option()
+#define LOWPOWER_RF_DEFAULT     0             // calibration according to the init data byte 108
+#define LOWPOWER_RF_FULLCAL     1             // full RF calibration (~200ms)
+#define LOWPOWER_RF_NOCAL       2             // reuse the stored calibration
+#define LOWPOWER_RF_DISABLED    4             // RF not powered
+#define LOWPOWER_RF_MODES       3             // number of RF enabled modes for statistics
+
+typedef struct s_lowPowerHeader {
+      uint16_t  remaining;      // intermediate wake-up before the scheduled one
+      uint32_t  chunkMs;        // duration of each chained deep sleep
+      uint32_t  overheadMs;     // awake time accumulated by the intermediate wake-ups
+      uint32_t  sleepMs;        // duration given to the last deepSleep() call
+
+      // RF power policy
+      uint8_t   rfMode;         // RF mode for the next scheduled wake-up
+      uint8_t   wakesSinceCal;  // scheduled wake-ups since the last full calibration
+      int16_t   calTemperature; // temperature (1/10 C) at last full calibration
+      uint16_t  calVoltage;     // voltage (mV) at last full calibration - 0 when never calibrated
+      uint16_t  latencyCnt[LOWPOWER_RF_MODES];    // scan start latency measures per rf mode
+      uint16_t  latencyAvgMs[LOWPOWER_RF_MODES];  // average scan start latency per rf mode
+} t_lowPowerHeader;
+
+#define LOWPOWER_CLOCK_VERSION  1             // RTC slot version of the sleep clock
+#define LOWPOWER_RTC_MAX_MEASURE_MS (6*60*60*1000)   // RTC time counter wraps after ~7 hours
+#define LOWPOWER_DRIFT_MAX_PPM  100000        // Ignore measures more than 10% away from the request
+
+typedef struct s_rtcClock {
+      uint32_t  rtcTime;        // system_get_rtc_time() when going to sleep
+      uint32_t  cali;           // system_rtc_clock_cali_proc() when going to sleep - us per tick Q12
+      uint32_t  requestedMs;    // sleep duration really requested to the hardware (after compensation)
+      int32_t   driftPpm;       // smoothed (measured - requested) / requested
+} t_rtcClock;
+
 class LowPowerClass {
 public:
-  bool wakeUp(uint8_t * context, uint32_t * crc32area, unsigned int sz);
-  void deepSleep(uint32_t durationMs, uint8_t * context, uint32_t * crc32area, unsigned int sz);
+  void chainedWakeUp();
+  bool wakeUp(uint8_t slot, uint8_t version, void * context, unsigned int sz);
+  void deepSleep(uint32_t durationMs);
+  uint32_t getChainOverheadMs();
+  uint32_t getLastSleepMs();
+  int32_t  getDriftPpm();
+
+  // RF power policy
+  static void rfPreInit();
+  void rfPowerUp();
+  bool rfPolicyNeedsSensors();
+  void rfPolicy(int16_t temperature, uint16_t voltage);
+  void recordScanLatency(uint32_t latencyMs);
+  void printRfStats();
+
+protected:
+  t_lowPowerHeader header;
+  uint8_t wakeRfMode;           // RF mode used for the current wake-up
+  t_rtcClock clock;
+  uint32_t lastSleepMs;         // measured duration from the last deepSleep() call - 0 when unknown
+
+  void measureSleep(bool restored);
 
+  static int  rfModeIndex(uint8_t mode);
+  static const char * rfModeName(uint8_t mode);
 };
 
 extern LowPowerClass lowPowerService;
@@ -28,19 +28,31 @@
 #include "debug.h"
 #include "logger.h"
 #include "low_power.h"
+#include "rtc_memory.h"
 #include "tracker.h"
 
+#define BOOT_COMMAND_PROBE_MS   500     // Serial activity detection after boot
+#define BOOT_COMMAND_WINDOW_MS 5000     // Command window when serial activity is detected
+
 int  bootTime,bootCycle;
 bool debugMode = false;
 bool debugModeLoop = false;
 bool inCommandMode = false;
 
+// Select the phy calibration level before the RF init, according to the RF policy
+RF_PRE_INIT() {
+  LowPowerClass::rfPreInit();
+}
+
 void setup() {
+  // Intermediate wake-up of a sleep chain returns to deep sleep from here
+  lowPowerService.chainedWakeUp();
+
   bootTime = millis();
   
   // Enable WatchDog
   ESP.wdtEnable(32000);                                                                       // 32s watchdog
-  Serial.begin(LOGGER_SERIAL_DEFAULT_SPEED);                                                  // needed for config load & lowpower trace on Serial
+  DEBUG_SERIAL.begin(LOGGER_SERIAL_DEFAULT_SPEED);                                            // needed for config load & lowpower trace on Serial
 
   // Disable Wifi
   WiFi.disconnect(); 
@@ -62,6 +74,7 @@ void setup() {
 
 void manageCommand() {
   char c;
+#if WISOL_TRANSPORT != WISOL_TRANSPORT_HWSERIAL                                               // Serial is the Wisol link otherwise, Serial1 has no RX
   if ( Serial.available() ) {
      char c = Serial.read();
      if ( c == '!' ) {
@@ -73,6 +86,7 @@ void manageCommand() {
         inCommandMode = false;
      }
   }
+#endif
 }
 
 
@@ -82,30 +96,40 @@ void loop() {
     // For real this loop will be executed only one time after every deep sleep wake up
     uint32_t elapsed = ( debugModeLoop )? 0 : millis(); 
     
-    if ( debugModeLoop || lowPowerService.wakeUp((uint8_t*)&trackrService.state, &trackrService.state.crc32, sizeof(trackrService.state)) ) {
+    if ( debugModeLoop || lowPowerService.wakeUp(RTC_SLOT_TRACKR, TRACKR_STATE_VERSION, &trackrService.state, sizeof(trackrService.state)) ) {
 
       // This is a standard loop from a device wake up signal or after an internal wait loop
       // We execute all what we have to do on regular basis
     
-      trackrService.execute(SCHEDULER_PERIOD_MS+elapsed);                              // Load the context from RTC memory & execute actions
+      trackrService.execute( (debugModeLoop)?SCHEDULER_PERIOD_MS:lowPowerService.getLastSleepMs() );  // Load the context from RTC memory & execute actions
     
     } else {
 
       // This is the first loop after powering ON the device
       // We can call boot method to execute all the first time settings 
       
-      trackrService.boot(elapsed+5000);                                               // What have to be done just one time on startup from a reset
-      // wait for potential debug mode switch for 5 seconds
+      trackrService.boot(elapsed+BOOT_COMMAND_PROBE_MS);                              // What have to be done just one time on startup from a reset
+      // Open the command window only when someone is talking on the serial line
+      // (chars received during boot are buffered) - STOP_PIN low already keeps the device awake
+#if WISOL_TRANSPORT != WISOL_TRANSPORT_HWSERIAL
       uint32_t start = millis();
-      while ( (millis() - start) < 5000 ) {
-        manageCommand();
+      while ( (millis() - start) < BOOT_COMMAND_PROBE_MS && ! Serial.available() ) {
+        delay(1);
+      }
+      if ( Serial.available() ) {
+        start = millis();
+        while ( (millis() - start) < BOOT_COMMAND_WINDOW_MS ) {
+          manageCommand();
+        }
       }
+#endif
+      TTRACE1(("Boot to sleep : %d ms\r\n",millis()));
     }
 
     if ( ! debugMode ) {
       // In the normal mod the ESP8266 is going deep sleep
       // going deep sleep...
-      lowPowerService.deepSleep( SCHEDULER_PERIOD_MS,(uint8_t*)&trackrService.state, &trackrService.state.crc32, sizeof(trackrService.state) );
+      lowPowerService.deepSleep( trackrService.getNextSleepMs() );
    
     } else {
       // debug mode, no sleep, always run so we can listen for command on the
@@ -0,0 +1,105 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Sigfox daily uplink quota
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+#include "quota.h"
+#include "logger.h"
+#include "rtc_memory.h"
+#include "counters.h"
+
+QuotaClass quotaService;
+
+static const uint16_t quotaReserve[QUOTA_PRIOS] = {
+  QUOTA_RESERVE_ALARM, QUOTA_RESERVE_POSITION, QUOTA_RESERVE_HEARTBEAT, QUOTA_RESERVE_HEALTH
+};
+
+/**
+ * Restore the counters from RTC memory, a cold boot starts with the full budget
+ */
+void QuotaClass::restore() {
+  if ( ! rtcMemoryService.attach(RTC_SLOT_QUOTA, QUOTA_VERSION, &quota, sizeof(t_quota)) ) {
+    memset(&quota,0,sizeof(t_quota));
+  }
+  rtcMemoryService.setDirty(RTC_SLOT_QUOTA);
+}
+
+/**
+ * Returns true when a frame of the given priority can be sent now, the
+ * refusal is counted
+ */
+bool QuotaClass::admit(uint8_t priority, uint32_t nowS) {
+  if ( allows(priority,nowS) ) return true;
+  if ( priority >= QUOTA_PRIOS ) priority = QUOTA_PRIOS-1;
+  if ( quota.refused[priority] < 0xFFFF ) quota.refused[priority]++;
+  countersService.inc(COUNTER_QUOTA_REFUSED);
+  _log.info("Quota : priority %d refused, %d uplinks left\r\n",priority,getRemaining(nowS));
+  return false;
+}
+
+/**
+ * Same as admit() without counting a refusal, to check the queued frames
+ */
+bool QuotaClass::allows(uint8_t priority, uint32_t nowS) {
+  if ( priority >= QUOTA_PRIOS ) priority = QUOTA_PRIOS-1;
+  return ( getRemaining(nowS) > quotaReserve[priority] );
+}
+
+/**
+ * Count an uplink transmitted now
+ */
+void QuotaClass::record(uint32_t nowS) {
+  roll(nowS);
+  uint8_t * c = &quota.counts[quota.hour % QUOTA_HOURS];
+  if ( *c < 0xFF ) (*c)++;
+}
+
+/**
+ * Uplinks left in the rolling 24 hours window
+ */
+uint16_t QuotaClass::getRemaining(uint32_t nowS) {
+  roll(nowS);
+  uint16_t used = 0;
+  for ( int i = 0 ; i < QUOTA_HOURS ; i++ ) used += quota.counts[i];
+  return ( used >= QUOTA_DAILY_UPLINKS )?0:QUOTA_DAILY_UPLINKS - used;
+}
+
+void QuotaClass::printStats(uint32_t nowS) {
+  _log.any("Quota : %d / %d uplinks left in 24h, refused alarm %d position %d heartbeat %d health %d\r\n",
+            getRemaining(nowS),QUOTA_DAILY_UPLINKS,quota.refused[QUOTA_PRIO_ALARM],quota.refused[QUOTA_PRIO_POSITION],
+            quota.refused[QUOTA_PRIO_HEARTBEAT],quota.refused[QUOTA_PRIO_HEALTH]);
+}
+
+// ==========================================================================
+// Internal functions
+
+/**
+ * Clear the hours elapsed since the last update
+ */
+void QuotaClass::roll(uint32_t nowS) {
+  uint32_t hour = nowS / 3600;
+  if ( hour <= quota.hour ) return;
+  uint32_t n = hour - quota.hour;
+  if ( n > QUOTA_HOURS ) n = QUOTA_HOURS;
+  for ( uint32_t i = 1 ; i <= n ; i++ ) quota.counts[(quota.hour + i) % QUOTA_HOURS] = 0;
+  quota.hour = hour;
+}
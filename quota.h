@@ -0,0 +1,73 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Sigfox daily uplink quota
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ * Uplinks are counted per hour over a rolling 24 hours window in RTC
+ * memory. A frame is admitted when the budget left is above the reserve
+ * of its priority, so the last messages of the day are kept for the
+ * most important frames.
+ */
+#ifndef QUOTA_H_
+#define QUOTA_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+#define QUOTA_VERSION           1         // RTC slot version of t_quota
+#define QUOTA_HOURS             24
+
+#define QUOTA_PRIO_ALARM        0
+#define QUOTA_PRIO_POSITION     1
+#define QUOTA_PRIO_HEARTBEAT    2
+#define QUOTA_PRIO_HEALTH       3
+#define QUOTA_PRIOS             4
+
+// Budget left in the window under which a priority is refused
+#define QUOTA_RESERVE_ALARM     0
+#define QUOTA_RESERVE_POSITION  (QUOTA_DAILY_UPLINKS/20)
+#define QUOTA_RESERVE_HEARTBEAT (QUOTA_DAILY_UPLINKS/4)
+#define QUOTA_RESERVE_HEALTH    (QUOTA_DAILY_UPLINKS/2)
+
+typedef struct s_quota {
+      uint32_t  hour;                   // hours since power on of the last update
+      uint8_t   counts[QUOTA_HOURS];    // uplinks per hour, indexed by hour % 24
+      uint16_t  refused[QUOTA_PRIOS];   // frames refused per priority
+} t_quota;
+
+class QuotaClass {
+public:
+  void restore();
+  bool admit(uint8_t priority, uint32_t nowS);
+  bool allows(uint8_t priority, uint32_t nowS);
+  void record(uint32_t nowS);
+  uint16_t getRemaining(uint32_t nowS);
+  void printStats(uint32_t nowS);
+
+protected:
+  t_quota quota;
+
+  void roll(uint32_t nowS);
+};
+
+extern QuotaClass quotaService;
+
+#endif
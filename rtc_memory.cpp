@@ -0,0 +1,210 @@
+/* ======================================================================
+    This file is part of disk91_lowpower.
+
+    disk91_lowpower is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+
+/* ======================================================================
+ *  ESP8266 RTC memory slot management module
+ * ----------------------------------------------------------------------
+ * (c) Disk91 - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+
+extern "C" {
+#include "tool.h"
+}
+#include <esp.h>
+#include "config.h"
+#include "debug.h"
+#include "rtc_memory.h"
+#include "low_power.h"
+#include "tracker.h"
+#include "wisol.h"
+#include "uplink_queue.h"
+#include "geofence.h"
+#include "quota.h"
+#include "wifiscan.h"
+#include "counters.h"
+
+RtcMemoryClass rtcMemoryService;
+
+/**
+ * RTC memory layout, one entry per slot identifier in the identifier order.
+ * Slots are packed one after the other, each one on a 4 bytes boundary.
+ * Adding a slot at the end keeps the previous slots in place.
+ */
+static const t_rtcSlotDef rtcLayout[RTC_SLOT_COUNT] = {
+  { "lowpower", sizeof(t_lowPowerHeader) },
+  { "trackr",   sizeof(t_state) },
+  { "clock",    sizeof(t_rtcClock) },
+  { "wisol",    sizeof(t_wisolPower) },
+  { "uplink",   sizeof(t_uplinkQueue) },
+  { "history",  sizeof(t_history) },
+  { "geofence", sizeof(t_geofence) },
+  { "quota",    sizeof(t_quota) },
+  { "wifistats",sizeof(t_wifiStats) },
+  { "scanprof", sizeof(t_scanProfiles) },
+  { "counters", sizeof(t_counters) },
+};
+
+/**
+ * Load the RTC memory content. When restore is false (cold boot) the RTC content is
+ * ignored and all the slots are invalid.
+ * The slots are not restored here, each owner attaches its own data with attach()
+ */
+void RtcMemoryClass::begin(bool restore) {
+  usedSz = slotOffset(RTC_SLOT_COUNT);
+  if ( usedSz > RTC_MAX_SZ ) {
+    TTRACE(("** Invalid RTC layout size (%d) !\r\n",usedSz));
+    while(true);
+  }
+  for ( int i = 0 ; i < RTC_SLOT_COUNT ; i++ ) {
+    slots[i].data = NULL;
+    slots[i].offset = slotOffset(i);
+    slots[i].dirty = false;
+    slots[i].valid = false;
+  }
+  crcErrors = 0;
+  restored = restore && ESP.rtcUserMemoryRead(0, mirror, usedSz);
+  if ( ! restored ) memset(mirror,0,sizeof(mirror));
+}
+
+/**
+ * Attach the owner data to a slot. The data size must be the one declared in the layout.
+ * When the RTC content has been loaded and the slot is valid (id, version and crc) the
+ * data are restored and the function returns true. Otherwise the data are untouched and
+ * the owner has to init them.
+ * A corrupted slot does not impact the other ones.
+ * Attaching again the same data (no deep sleep in between) keeps them untouched.
+ */
+bool RtcMemoryClass::attach(uint8_t id, uint8_t version, void * data, uint16_t sz) {
+  if ( id >= RTC_SLOT_COUNT || sz != rtcLayout[id].size ) {
+    TTRACE(("** Invalid RTC slot %d size %d !\r\n",id,sz));
+    while(true);
+  }
+  t_rtcSlot * slot = &slots[id];
+  if ( slot->data == data ) return true;          // already attached, owner data are up to date
+  slot->data = (uint8_t *)data;
+  slot->version = version;
+  slot->valid = false;
+
+  if ( restored ) {
+    uint8_t * raw = ((uint8_t*)mirror) + slot->offset;
+    t_rtcSlotHeader * h = (t_rtcSlotHeader *)raw;
+    if ( h->id == id && h->version == version && h->crc == slotCrc(raw,sz) ) {
+      memcpy(data,raw+sizeof(t_rtcSlotHeader),sz);
+      slot->valid = true;
+    } else {
+      TTRACE(("RTC slot %s invalid\r\n",rtcLayout[id].name));
+      if ( crcErrors < 0xFF ) crcErrors++;
+      countersService.inc(COUNTER_RTC_CRC);
+    }
+  }
+  return slot->valid;
+}
+
+/**
+ * Mark a slot as modified, it will be written on next commit
+ */
+void RtcMemoryClass::setDirty(uint8_t id) {
+  if ( id < RTC_SLOT_COUNT ) slots[id].dirty = true;
+}
+
+/**
+ * Checksum and write the dirty slots into the RTC memory. Clean slots are
+ * not touched.
+ */
+void RtcMemoryClass::commit() {
+  for ( int i = 0 ; i < RTC_SLOT_COUNT ; i++ ) {
+    t_rtcSlot * slot = &slots[i];
+    if ( slot->data == NULL || ! slot->dirty ) continue;
+
+    uint16_t sz = rtcLayout[i].size;
+    uint8_t * raw = ((uint8_t*)mirror) + slot->offset;
+    t_rtcSlotHeader * h = (t_rtcSlotHeader *)raw;
+    memset(raw,0,sizeof(t_rtcSlotHeader) + RTC_SLOT_ALIGN(sz));
+    memcpy(raw+sizeof(t_rtcSlotHeader),slot->data,sz);
+    h->id = i;
+    h->version = slot->version;
+    h->crc = slotCrc(raw,sz);
+    if ( ! ESP.rtcUserMemoryWrite(slot->offset/4, (uint32_t*)raw, sizeof(t_rtcSlotHeader) + RTC_SLOT_ALIGN(sz)) ) {
+      TTRACE(("Error when writting RTC Memory\r\n"));
+    }
+    slot->dirty = false;
+  }
+}
+
+/**
+ * Number of slots found corrupted during the attach calls since begin
+ */
+uint8_t RtcMemoryClass::getCrcErrors() {
+  return crcErrors;
+}
+
+/**
+ * Print the RTC memory layout and the slots status
+ */
+void RtcMemoryClass::printLayout() {
+  TTRACE(("-------- RTC memory --------\r\n"));
+  for ( int i = 0 ; i < RTC_SLOT_COUNT ; i++ ) {
+    TTRACE((" %-10s @%3d : %3d bytes - %s%s\r\n",rtcLayout[i].name,slots[i].offset,rtcLayout[i].size,
+             (slots[i].valid)?"restored":"init",(slots[i].data==NULL)?" (not attached)":""));
+  }
+  TTRACE((" Used : %d / %d bytes\r\n",usedSz,RTC_MAX_SZ));
+}
+
+/**
+ * Read a slot directly from the RTC memory without using the object state. This is
+ * usable before the global objects are constructed (RF pre init).
+ * Return true when the slot is valid and data have been loaded.
+ */
+bool RtcMemoryClass::peek(uint8_t id, uint8_t version, void * data, uint16_t sz) {
+  uint32_t raw[(sizeof(t_rtcSlotHeader) + RTC_SLOT_ALIGN(RTC_MAX_SZ))/4];
+  if ( id >= RTC_SLOT_COUNT || sz != rtcLayout[id].size ) return false;
+  uint16_t len = sizeof(t_rtcSlotHeader) + RTC_SLOT_ALIGN(sz);
+  if ( ! ESP.rtcUserMemoryRead(slotOffset(id)/4, raw, len) ) return false;
+  t_rtcSlotHeader * h = (t_rtcSlotHeader *)raw;
+  if ( h->id != id || h->version != version || h->crc != slotCrc((uint8_t*)raw,sz) ) return false;
+  memcpy(data,((uint8_t*)raw)+sizeof(t_rtcSlotHeader),sz);
+  return true;
+}
+
+// ==========================================================================
+// Internal functions
+
+/**
+ * Offset in bytes of a slot, computed from the layout
+ */
+uint16_t RtcMemoryClass::slotOffset(uint8_t id) {
+  uint16_t offset = 0;
+  for ( int i = 0 ; i < id ; i++ ) {
+    offset += sizeof(t_rtcSlotHeader) + RTC_SLOT_ALIGN(rtcLayout[i].size);
+  }
+  return offset;
+}
+
+/**
+ * CRC of a slot (header + data) with the crc field set to 0, the data size
+ * is mixed in so a layout change invalidates the slot.
+ */
+uint16_t RtcMemoryClass::slotCrc(const uint8_t * slot, uint16_t sz) {
+  uint8_t hdr[sizeof(t_rtcSlotHeader)];
+  memcpy(hdr,slot,sizeof(t_rtcSlotHeader));
+  ((t_rtcSlotHeader *)hdr)->crc = 0;
+  uint32_t crc = calculateCRC32(hdr,sizeof(t_rtcSlotHeader)) ^ calculateCRC32(slot+sizeof(t_rtcSlotHeader),sz) ^ sz;
+  return (uint16_t)( (crc >> 16) ^ (crc & 0xFFFF) );
+}
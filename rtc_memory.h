@@ -0,0 +1,97 @@
+/* ======================================================================
+    This file is part of disk91_lowpower.
+
+    disk91_lowpower is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+
+/* ======================================================================
+ *  ESP8266 RTC memory slot management module
+ * ----------------------------------------------------------------------
+ * (c) Disk91 - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef RTCMEMORY_H_
+#define RTCMEMORY_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+// -------------------------------------------------
+// Slot identifiers - the RTC layout follows this order (see rtc_memory.cpp)
+#define RTC_SLOT_LOWPOWER     0
+#define RTC_SLOT_TRACKR       1
+#define RTC_SLOT_CLOCK        2
+#define RTC_SLOT_WISOL        3
+#define RTC_SLOT_UPLINK       4
+#define RTC_SLOT_HISTORY      5
+#define RTC_SLOT_GEOFENCE     6
+#define RTC_SLOT_QUOTA        7
+#define RTC_SLOT_WIFISTATS    8
+#define RTC_SLOT_SCANPROF     9
+#define RTC_SLOT_COUNTERS     10
+#define RTC_SLOT_COUNT        11
+
+#define RTC_SLOT_ALIGN(x)     (((x)+3) & ~3)
+
+/**
+ * Each slot is stored in RTC memory as a 4 bytes header followed by the
+ * data padded to a 4 bytes boundary.
+ */
+typedef struct s_rtcSlotHeader {
+      uint8_t   id;
+      uint8_t   version;
+      uint16_t  crc;          // CRC of the header (crc=0) and the data, folded on 16 bits
+} t_rtcSlotHeader;
+
+typedef struct s_rtcSlotDef {
+      const char * name;
+      uint16_t  size;         // size of the typed data in bytes
+} t_rtcSlotDef;
+
+typedef struct s_rtcSlot {
+      uint8_t * data;         // owner data, NULL when not attached
+      uint16_t  offset;       // offset in bytes of the slot header in RTC memory
+      uint8_t   version;
+      bool      dirty;        // data have to be written on next commit
+      bool      valid;        // data have been restored from RTC memory
+} t_rtcSlot;
+
+class RtcMemoryClass {
+public:
+  void begin(bool restore);
+  bool attach(uint8_t id, uint8_t version, void * data, uint16_t sz);
+  void setDirty(uint8_t id);
+  void commit();
+  uint8_t getCrcErrors();
+  void printLayout();
+
+  static bool peek(uint8_t id, uint8_t version, void * data, uint16_t sz);
+
+protected:
+  t_rtcSlot slots[RTC_SLOT_COUNT];
+  uint32_t  mirror[RTC_MAX_SZ/4];       // copy of the RTC memory content
+  uint16_t  usedSz;
+  uint8_t   crcErrors;
+  bool      restored;
+
+  static uint16_t slotOffset(uint8_t id);
+  static uint16_t slotCrc(const uint8_t * slot, uint16_t sz);
+};
+
+extern RtcMemoryClass rtcMemoryService;
+
+#endif
@@ -0,0 +1,151 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Cooperative run-to-completion task scheduler
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+#include "scheduler.h"
+#include "logger.h"
+
+SchedulerClass schedulerService;
+
+/**
+ * Remove all the tasks
+ */
+void SchedulerClass::reset() {
+  count = 0;
+  readyHead = 0;
+  readyLen = 0;
+}
+
+/**
+ * Add a task, its first step runs as soon as the task given in after is
+ * completed (or immediately with SCHEDULER_NO_TASK).
+ * Return the task id or SCHEDULER_NO_TASK when the table is full.
+ */
+uint8_t SchedulerClass::add(const char * name, t_taskStep step, void * ctx, uint8_t after) {
+  if ( count >= SCHEDULER_MAX_TASK ) return SCHEDULER_NO_TASK;
+  t_task * t = &tasks[count];
+  t->name = name;
+  t->step = step;
+  t->ctx = ctx;
+  t->state = SCHEDULER_TASK_WAIT;
+  t->after = after;
+  t->steps = 0;
+  t->wakeAt = millis();
+  t->startMs = 0;
+  t->endMs = 0;
+  t->busyMs = 0;
+  t->waitMs = 0;
+  return count++;
+}
+
+bool SchedulerClass::isDone(uint8_t id) {
+  return ( id < count && tasks[id].state == SCHEDULER_TASK_DONE );
+}
+
+/**
+ * Run the tasks until all of them are completed. Timers elapsed tasks are
+ * moved to the ready queue in their order, the ready tasks are executed one
+ * step at a time. When nothing is ready the CPU waits for the next timer.
+ */
+void SchedulerClass::run() {
+  runStart = millis();
+  while ( true ) {
+    uint32_t now = millis();
+    uint32_t nextWake = 0xFFFFFFFF;
+    bool pending = false;
+
+    // timers
+    for ( uint8_t i = 0 ; i < count ; i++ ) {
+      t_task * t = &tasks[i];
+      if ( t->state != SCHEDULER_TASK_WAIT ) {
+        if ( t->state == SCHEDULER_TASK_READY ) pending = true;
+        continue;
+      }
+      pending = true;
+      if ( t->after != SCHEDULER_NO_TASK && ! isDone(t->after) ) continue;
+      if ( (int32_t)(now - t->wakeAt) >= 0 ) {
+        pushReady(i);
+      } else if ( t->wakeAt - now < nextWake ) {
+        nextWake = t->wakeAt - now;
+      }
+    }
+    if ( ! pending ) break;
+
+    // ready queue
+    if ( readyLen == 0 ) {
+      if ( nextWake != 0xFFFFFFFF ) delay(nextWake); else delay(1);
+      continue;
+    }
+    t_task * t = &tasks[popReady()];
+    uint32_t s = millis();
+    if ( t->steps == 0 ) t->startMs = s - runStart;
+    uint32_t d = t->step(t->ctx);
+    uint32_t e = millis();
+    t->steps++;
+    t->busyMs += e - s;
+    if ( d == SCHEDULER_DONE ) {
+      t->state = SCHEDULER_TASK_DONE;
+      t->endMs = e - runStart;
+    } else {
+      t->state = SCHEDULER_TASK_WAIT;
+      t->wakeAt = e + d;
+      t->waitMs += d;
+    }
+    yield();
+  }
+  runEnd = millis();
+}
+
+/**
+ * Print the execution trace of the last run. The start / end span of a task includes the
+ * steps of the other tasks, so the sequential time is the sum of the busy time and of the
+ * delays requested by each task : what the same work costs executed one after the other.
+ */
+void SchedulerClass::printTrace() {
+  uint32_t sequential = 0;
+  _log.debug("+------ tasks ------+-------+-------+------+------+-------+\r\n");
+  _log.debug("| name              | start |  end  | busy | wait | steps |\r\n");
+  for ( uint8_t i = 0 ; i < count ; i++ ) {
+    t_task * t = &tasks[i];
+    _log.debug("| %-17s | %5d | %5d | %4d | %4d | %5d |\r\n",t->name,t->startMs,t->endMs,t->busyMs,t->waitMs,t->steps);
+    sequential += t->busyMs + t->waitMs;
+  }
+  _log.debug("+-------------------+-------+-------+------+------+-------+\r\n");
+  _log.debug("Tasks run in %d ms (sequential %d ms)\r\n",runEnd-runStart,sequential);
+}
+
+// ==========================================================================
+// Internal functions
+
+void SchedulerClass::pushReady(uint8_t id) {
+  readyQueue[(readyHead + readyLen) % SCHEDULER_MAX_TASK] = id;
+  readyLen++;
+  tasks[id].state = SCHEDULER_TASK_READY;
+}
+
+uint8_t SchedulerClass::popReady() {
+  uint8_t id = readyQueue[readyHead];
+  readyHead = (readyHead + 1) % SCHEDULER_MAX_TASK;
+  readyLen--;
+  return id;
+}
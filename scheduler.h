@@ -0,0 +1,82 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Cooperative run-to-completion task scheduler
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <Arduino.h>
+
+#define SCHEDULER_MAX_TASK    8
+#define SCHEDULER_NO_TASK     0xFF
+#define SCHEDULER_DONE        0xFFFFFFFF      // step return value when the task is completed
+
+#define SCHEDULER_TASK_FREE   0
+#define SCHEDULER_TASK_WAIT   1               // waiting for its timer or its dependency
+#define SCHEDULER_TASK_READY  2               // in the ready queue
+#define SCHEDULER_TASK_DONE   3
+
+/**
+ * A step function executes a short piece of work without blocking and returns
+ * the delay in Ms before the next step, or SCHEDULER_DONE.
+ */
+typedef uint32_t (*t_taskStep)(void * ctx);
+
+typedef struct s_task {
+      const char * name;
+      t_taskStep   step;
+      void *       ctx;
+      uint8_t      state;
+      uint8_t      after;       // task to be completed before this one starts
+      uint16_t     steps;       // number of steps executed
+      uint32_t     wakeAt;      // millis() when the next step can run
+      uint32_t     startMs;     // trace - first step
+      uint32_t     endMs;       // trace - completion
+      uint32_t     busyMs;      // trace - time spent in the steps
+      uint32_t     waitMs;      // trace - delays requested by the steps
+} t_task;
+
+class SchedulerClass {
+public:
+  void reset();
+  uint8_t add(const char * name, t_taskStep step, void * ctx, uint8_t after = SCHEDULER_NO_TASK);
+  void run();
+  bool isDone(uint8_t id);
+  void printTrace();
+
+protected:
+  t_task   tasks[SCHEDULER_MAX_TASK];
+  uint8_t  count;
+  uint8_t  readyQueue[SCHEDULER_MAX_TASK];
+  uint8_t  readyHead;
+  uint8_t  readyLen;
+  uint32_t runStart;
+  uint32_t runEnd;
+
+  void pushReady(uint8_t id);
+  uint8_t popReady();
+};
+
+extern SchedulerClass schedulerService;
+
+#endif
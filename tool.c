@@ -190,3 +190,30 @@ void dsk_macToString(char * str, uint8_t * mac) {
   str[17]='\0';
 }
 
+
+/* ----------------------------------------------------
+ *  Write the n lower bits of v in buf at the bit position
+ *  pos, most significant bit first. pos is updated.
+ *  The buffer must be zeroed before the first write.
+ */
+void dsk_putBits(uint8_t * buf, uint16_t * pos, uint32_t v, uint8_t n) {
+  while ( n > 0 ) {
+    n--;
+    if ( (v >> n) & 1 ) buf[*pos >> 3] |= 0x80 >> (*pos & 7);
+    (*pos)++;
+  }
+}
+
+/* ----------------------------------------------------
+ *  Read n bits from buf at the bit position pos, most
+ *  significant bit first. pos is updated.
+ */
+uint32_t dsk_getBits(uint8_t * buf, uint16_t * pos, uint8_t n) {
+  uint32_t v = 0;
+  while ( n > 0 ) {
+    n--;
+    v = (v << 1) | ( (buf[*pos >> 3] >> (7 - (*pos & 7))) & 1 );
+    (*pos)++;
+  }
+  return v;
+}
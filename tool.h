@@ -43,4 +43,9 @@ uint16_t dsk_convertDecChar4Int(char * v);
 void dsk_convertHexStr2IntTab(char * hexstr,uint8_t * tab, int len);
 void dsk_macToString(char * str, uint8_t * mac);
 
+// ------------------------------------------------------------------------
+// Bit packing
+void dsk_putBits(uint8_t * buf, uint16_t * pos, uint32_t v, uint8_t n);
+uint32_t dsk_getBits(uint8_t * buf, uint16_t * pos, uint8_t n);
+
 #endif
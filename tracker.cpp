@@ -29,7 +29,16 @@
 #include "wisol.h"
 #include "wifiscan.h"
 #include "logger.h"
-#include "wisol.h"
+#include "low_power.h"
+#include "rtc_memory.h"
+#include "scheduler.h"
+#include "wisol_transport.h"
+#include "uplink_queue.h"
+#include "frame_codec.h"
+#include "geofence.h"
+#include "quota.h"
+#include "energy.h"
+#include "counters.h"
  extern "C" {
    #include "tool.h"
  }
@@ -37,6 +46,11 @@
 
 TrackrClass trackrService;
 
+static const uint32_t trackrDeadlineMs[TRACKR_PHASES] = {
+  TRACKR_WAKE_BUDGET_MS, TRACKR_DEADLINE_WAKE_MS, TRACKR_DEADLINE_POSITION_MS,
+  TRACKR_DEADLINE_HISTORY_MS, TRACKR_DEADLINE_HEALTH_MS, TRACKR_DEADLINE_SENSORS_MS
+};
+static const char * trackrPhaseNames[TRACKR_PHASES] = { "none", "wake-up", "position", "history", "health", "sensors" };
 
 
 /**
@@ -44,17 +58,21 @@ TrackrClass trackrService;
  * elapsedTime = time elapsed in Ms since power on.
  */
 void TrackrClass::boot(uint32_t elapsedTime) {
-    char buf[128];
     uint32_t start = millis();
+    wisolService.restorePowerState(0);
+    wisolService.setDeadline(wisolService.getAwakeMs() + TRACKR_WAKE_BUDGET_MS);
 
-    // Wisol Hardware reset
-    wisolService.wakeUp();
-    wisolService.reset();
+    // Wisol Hardware reset runs concurrently with the software components init
+    schedulerService.reset();
+    uint8_t wake = schedulerService.add("wisol wake-up",WisolClass::wakeUpTask,&wisolService);
+    schedulerService.add("wisol reset",WisolClass::resetTask,&wisolService,wake);
+    schedulerService.add("config & log",TrackrClass::bootConfigTask,this);
+    schedulerService.run();
+    countersService.restore();                        // from the flash checkpoint, SPIFFS is mounted
 
-    // Init software components
-    configService.init(true);                         // Load the configuration from flash or create it - @TODO : remove forcReset with false
-    _log.init(configService.config.logConfig);        // init logging engine
-    this->init();
+    // Sigfox Id needs the Wisol to be ready, the default config is flashed once with it
+    configService.setSigfoxId(wisolService.getSigfoxIdWithRetry(3));
+    configService.commit();
 
     // Boot messages
     _log.any("*** boot - TrackR - version %02X \r\n",FIRMWARE_VERSION);
@@ -64,14 +82,16 @@ void TrackrClass::boot(uint32_t elapsedTime) {
     _log.debug("Boot Mode: %u\r\n", ESP.getBootMode());  
     _log.debug("CPU Frequency: %u MHz\r\n", ESP.getCpuFreqMHz());
     _log.debug("Flash Size: %u \r\n", ESP.getFlashChipSize());
-
-
+    schedulerService.printTrace();
 
     // Terminate boot
     wisolService.sleepMode();  
-    delay(2000);
+    _log.info("Wisol transitions today : %d\r\n",wisolService.getTransitionsToday());
+    this->accountEnergy(0,0);
+    wisolService.setDeadline(0);
     _log.close();
     state.totalMs = elapsedTime + (millis() - start);
+    rtcMemoryService.setDirty(RTC_SLOT_TRACKR);
 }
 
 /**
@@ -81,46 +101,233 @@ void TrackrClass::boot(uint32_t elapsedTime) {
  */
 void TrackrClass::execute(uint32_t elapsedTime) {
     uint32_t start = millis();
-    uint8_t  mac1[6];
-    uint8_t  mac2[6];
+    wisolService.restorePowerState( (state.totalMs + elapsedTime) / (24*3600*1000LL) );
+    wakeStartMs = wisolService.getAwakeMs();
+    wisolService.setDeadline(wakeStartMs + TRACKR_WAKE_BUDGET_MS);    // the waits on the Wisol can't exceed the wake-up budget
+    aborted = false;
+    uplinkQueueService.restore();
+    geofenceService.restore();
+    quotaService.restore();
+    if ( ! rtcMemoryService.attach(RTC_SLOT_HISTORY, TRACKR_HISTORY_VERSION, &history, sizeof(t_history)) ) {
+      memset(&history,0,sizeof(t_history));
+    }
+    rtcMemoryService.setDirty(RTC_SLOT_HISTORY);
+    // with batching, the intermediate wake-ups only scan and the Wisol stays asleep
+    bool transmit = ( history.count >= TRACKR_BATCH_SCANS-1 );
 
-    // Reinit hardware - reload config
-    configService.init(false);                        // load the configuratin from flash
-    _log.init(configService.config.logConfig);        // init logging engine
+    // Independent work runs interleaved : the WiFi scan runs in the background
+    // while the config / logger are loaded (SPIFFS mount) and the Wisol wakes up
+    wifiscanService.prepareScan(6000,4,true);
+    schedulerService.reset();
+    schedulerService.add("wifi scan",WifiScanClass::scanTask,&wifiscanService);
+    schedulerService.add("config & log",TrackrClass::configTask,this);
+    if ( transmit ) schedulerService.add("wisol wake-up",WisolClass::wakeUpTask,&wisolService);
+    schedulerService.run();
+    wifiscanService.setProfile(configService.config.scanProfile,configService.config.traceScans);  // config is loaded now, used by the next scan
+    countersService.restore();
 
     // What we want to do on every wakeup
     this->printTime();
+    schedulerService.printTrace();
+    wifiscanService.printScan();
+    state.wakes++;
+    this->inTime(TRACKR_PHASE_WAKE,0);
 
-    // Scan for Wifi
-    uint8_t msg[12];
-    wifiscanService.startScan(6000,4,true);
-    if ( wifiscanService.getFirstAndSecondBestWiFi(mac1, mac2) == 2 ) {
-      char macStr[20];
-      dsk_macToString(macStr,mac1);
-      _log.info("1. %s\r\n",macStr);
-      dsk_macToString(macStr,mac2);
-      _log.info("2. %s\r\n",macStr);   
-
-      // Prepare the frame !
-      for ( int i = 0 ; i < 6 ; i++ ) {
-        msg[i]=mac1[i];
-        msg[i+6]=mac2[i];
-      }
+    if ( ! transmit ) {
+      this->recordScan();
+      lowPowerService.rfPolicy(WISOL_INVALID_TEMPERATURE,WISOL_INVALID_VOLTAGE);
     } else {
-      // send a frame with MAC 00:00:00:00:00:00 to get a network position
-      for ( int i = 0 ; i < 12 ; i++ ) {
-        msg[i]=0;
-      }      
+      wisolService.beginSession();                      // awake already, the session groups the AT commands
+      if ( configService.config.sigfoxId == 0 ) {
+        // default config has been restored, the Wisol is awake now
+        configService.setSigfoxId(wisolService.getSigfoxIdWithRetry(3));
+      }
+
+      // Prepare the frame : 2 MACs for Atlas or the device status when there are not enough APs
+      t_frame frame;
+      t_wisolInfo info;
+      info.valid = 0;
+      info.temperature = WISOL_INVALID_TEMPERATURE;
+      info.voltage = WISOL_INVALID_VOLTAGE;
+      if ( wifiscanService.getFirstAndSecondBestWiFi(frame.macs, &frame.macs[6]) == 2 ) {
+        frame.type = FRAME_TYPE_ATLAS;
+      } else {
+        wisolService.query(&info,WISOL_QUERY_TEMP|WISOL_QUERY_VOLT,2);
+        frame.type = FRAME_TYPE_NOFIX;
+        frame.noFix.voltage = info.voltage;
+        frame.noFix.temperature = info.temperature;
+        frame.noFix.apCount = wifiscanService.getApCount();
+        frame.noFix.wakes = state.wakes;
+        frame.noFix.uplinkFailures = uplinkQueueService.getFailures();
+        frame.noFix.pending = uplinkQueueService.pending();
+        frame.noFix.wisolFailures = wisolService.getPowerFailures();
+        frame.noFix.rtcErrors = rtcMemoryService.getCrcErrors();
+      }
+      // known places are reported with a short frame, or not at all when the device did not move,
+      // unless scans are batched : the multi-fix frame is resolved with the Atlas frame
+      if ( this->inTime(TRACKR_PHASE_POSITION,ENERGY_UPLINK_MS) && geofenceService.prepare(&frame,state.wakes,history.count > 0) ) {
+        frameCodec.print(&frame);
+        uint8_t msg[FRAME_MAX_SZ];
+        uint8_t len = frameCodec.encode(&frame,msg);
+        uint8_t priority = ( frame.type == FRAME_TYPE_NOFIX || (frame.type == FRAME_TYPE_PLACE && frame.place.heartbeat) )?QUOTA_PRIO_HEARTBEAT:QUOTA_PRIO_POSITION;
+        if ( uplinkQueueService.send(msg,len,priority,(state.totalMs + elapsedTime + (millis() - start)) / 1000) == WISOL_STATUS_SEND_OK ) {
+          geofenceService.delivered(&frame,state.wakes);
+        }
+      }
+      this->sendHistory((state.totalMs + elapsedTime + (millis() - start)) / 1000);
+      this->sendHealth(&info,(state.totalMs + elapsedTime + (millis() - start)) / 1000);
+
+      if ( info.valid == 0 && lowPowerService.rfPolicyNeedsSensors() && this->inTime(TRACKR_PHASE_SENSORS,TRACKR_SENSORS_MS) ) {
+        wisolService.query(&info,WISOL_QUERY_TEMP|WISOL_QUERY_VOLT,2);
+      }
+      lowPowerService.rfPolicy(info.temperature,info.voltage);
+      wisolService.endSession();
     }
-    wisolService.wakeUp();
-    wisolService.sendRaw(msg,12,false,NULL);
-    wisolService.sleepMode();
 
     // Prepare to sleep
+    this->accountEnergy(elapsedTime,wifiscanService.getLastScanMs());
+    countersService.tick();
+    configService.commit();
+    wisolService.setDeadline(0);                      // no limit for the commands of the debug mode
     _log.close();
     state.totalMs += elapsedTime + (millis() - start);
+    rtcMemoryService.setDirty(RTC_SLOT_TRACKR);
 }
 
+/**
+ * Store the best AP of the last scan in the history, only the 3 lower
+ * bytes of the MAC are kept : the backend matches them against the MACs
+ * of the Atlas frames sent before and after.
+ */
+void TrackrClass::recordScan() {
+  uint8_t mac[6];
+  int8_t  rssi;
+  if ( history.count >= FRAME_MULTIFIX_MAX ) return;
+  t_frameFix * f = &history.fixes[history.count];
+  if ( wifiscanService.getBestWiFi(mac,&rssi) ) {
+    for ( int k = 0 ; k < 3 ; k++ ) f->nic[k] = mac[k+3];
+    f->rssi = rssi;
+  } else {
+    memset(f->nic,0,3);
+    f->rssi = FRAME_RSSI_MIN;
+  }
+  history.count++;
+  _log.info("Scan recorded %d/%d\r\n",history.count,TRACKR_BATCH_SCANS);
+}
+
+/**
+ * Send the scans recorded since the last transmission in a multi-fix frame,
+ * oldest first.
+ */
+void TrackrClass::sendHistory(uint32_t nowS) {
+  if ( history.count == 0 || ! this->inTime(TRACKR_PHASE_HISTORY,ENERGY_UPLINK_MS) ) return;
+  t_frame frame;
+  frame.type = FRAME_TYPE_MULTIFIX;
+  frame.multiFix.count = history.count;
+  memcpy(frame.multiFix.fixes,history.fixes,history.count*sizeof(t_frameFix));
+  frameCodec.print(&frame);
+  uint8_t msg[FRAME_MAX_SZ];
+  uint8_t len = frameCodec.encode(&frame,msg);
+  uplinkQueueService.send(msg,len,QUOTA_PRIO_POSITION,nowS);
+  _log.info("Batch : %d previous scans sent\r\n",history.count);
+  history.count = 0;
+}
+
+/**
+ * Send the health frame and the counters frame once per TRACKR_HEALTH_PERIOD_S,
+ * the Wisol session must be open. The voltage is read when not already in info.
+ * A health frame refused by the quota is sent again on the next transmission.
+ */
+void TrackrClass::sendHealth(t_wisolInfo * info, uint32_t nowS) {
+  if ( nowS - state.healthS < TRACKR_HEALTH_PERIOD_S || ! this->inTime(TRACKR_PHASE_HEALTH,2*ENERGY_UPLINK_MS) ) return;
+  if ( (info->valid & WISOL_QUERY_VOLT) == 0 ) {
+    t_wisolInfo v;
+    if ( wisolService.query(&v,WISOL_QUERY_VOLT,2) ) {
+      info->valid |= WISOL_QUERY_VOLT;
+      info->voltage = v.voltage;
+    }
+  }
+  t_frame frame;
+  frame.type = FRAME_TYPE_HEALTH;
+  uint64_t mAh = state.chargeNAh / 1000000;
+  frame.health.chargeMAh = ( mAh > 0xFFFF )?0xFFFF:mAh;
+  frame.health.wakes = state.wakes;
+  frame.health.avgAwakeMs = ( state.wakes > 0 )?state.awakeMs / state.wakes:0;
+  frame.health.voltage = info->voltage;
+  frameCodec.print(&frame);
+  uint8_t msg[FRAME_MAX_SZ];
+  uint8_t len = frameCodec.encode(&frame,msg);
+  if ( uplinkQueueService.send(msg,len,QUOTA_PRIO_HEALTH,nowS) == UPLINK_STATUS_REFUSED ) return;
+
+  frame.type = FRAME_TYPE_COUNTERS;
+  for ( int i = 0 ; i < FRAME_COUNTERS ; i++ ) frame.counters[i] = countersService.get(i);
+  frameCodec.print(&frame);
+  len = frameCodec.encode(&frame,msg);
+  uplinkQueueService.send(msg,len,QUOTA_PRIO_HEALTH,nowS);
+  state.healthS = nowS;
+}
+
+/**
+ * Add the charge of the wake-up and of the sleep before it to the estimation :
+ * measured phase durations multiplied by the ENERGY_xx currents.
+ * millis() does not count the light sleep of the uplinks.
+ */
+void TrackrClass::accountEnergy(uint32_t sleepMs, uint32_t scanMs) {
+  uint32_t cpuMs = millis();
+  uint32_t sleptMs = wisolService.getUplinkSleptMs();
+  uint64_t nAh = ENERGY_NAH(ENERGY_DEEPSLEEP_UA,sleepMs)
+               + ENERGY_NAH(ENERGY_WIFI_UA,scanMs)
+               + ENERGY_NAH(ENERGY_CPU_UA,(cpuMs > scanMs)?cpuMs - scanMs:0)
+               + ENERGY_NAH(ENERGY_LIGHTSLEEP_UA,sleptMs)
+               + ENERGY_NAH(ENERGY_WISOL_TX_UA,wisolService.getUplinkMs());
+  state.chargeNAh += nAh;
+  state.awakeMs += cpuMs + sleptMs;
+  _log.info("Energy : %d uAh this wake-up, %d mAh since power on\r\n",(uint32_t)(nAh/1000),(uint32_t)(state.chargeNAh/1000000));
+}
+
+/**
+ * Deadline supervisor : returns true when a phase expected to last needMs
+ * ends before its deadline, counted from the start of execute(). Otherwise
+ * the first overrun of the wake-up is recorded in the state and the
+ * optional phases are skipped.
+ */
+bool TrackrClass::inTime(uint8_t phase, uint32_t needMs) {
+  if ( aborted && phase > TRACKR_PHASE_POSITION ) return false;
+  uint32_t nowMs = wisolService.getAwakeMs() - wakeStartMs;
+  if ( nowMs + needMs <= trackrDeadlineMs[phase] ) return true;
+  if ( ! aborted ) {
+    if ( state.overruns < 0xFFFF ) state.overruns++;
+    state.overrunPhase = phase;
+    state.overrunS = ( nowMs/1000 > 0xFF )?0xFF:nowMs/1000;
+    aborted = true;
+  }
+  _log.warn("Deadline : %s phase at %d ms, deadline %d ms - optional work skipped\r\n",trackrPhaseNames[phase],nowMs,trackrDeadlineMs[phase]);
+  return false;
+}
+
+void TrackrClass::printOverruns() {
+  _log.any("Deadline : %d overruns, last %s phase at %d s, budget %d ms\r\n",state.overruns,
+            trackrPhaseNames[(state.overrunPhase < TRACKR_PHASES)?state.overrunPhase:TRACKR_PHASE_NONE],state.overrunS,TRACKR_WAKE_BUDGET_MS);
+}
+
+/**
+ * Reinit the software components - reload config & start logging
+ */
+uint32_t TrackrClass::configTask(void * ctx) {
+    configService.init(false,true);                   // load the configuratin from flash, a default config is stored at the end of execute()
+    _log.init(configService.config.logConfig);        // init logging engine
+    return SCHEDULER_DONE;
+}
+
+/**
+ * Init the software components on boot - create the config & start logging
+ */
+uint32_t TrackrClass::bootConfigTask(void * ctx) {
+    configService.init(true,true);                    // Load the configuration from flash or create it - @TODO : remove forcReset with false
+    _log.init(configService.config.logConfig);        // init logging engine
+    ((TrackrClass *)ctx)->init();
+    return SCHEDULER_DONE;
+}
 
 /**
  * Init the device state after a cold restart.
@@ -128,9 +335,26 @@ void TrackrClass::execute(uint32_t elapsedTime) {
 bool TrackrClass::init() {
   _log.info("State Init\r\n");
   state.totalMs = 0;
+  state.wakes = 0;
+  state.chargeNAh = 0;
+  state.awakeMs = 0;
+  state.healthS = 0;
+  state.overruns = 0;
+  state.overrunPhase = TRACKR_PHASE_NONE;
+  state.overrunS = 0;
   
 }
 
+/**
+ * Return the sleep duration to wake up on the next multiple of SCHEDULER_PERIOD_MS
+ * since power on, so uplinks stay aligned on the schedule.
+ */
+uint32_t TrackrClass::getNextSleepMs() {
+  uint32_t next = SCHEDULER_PERIOD_MS - (uint32_t)(state.totalMs % SCHEDULER_PERIOD_MS);
+  if ( next < TRACKR_MIN_SLEEP_MS ) next += SCHEDULER_PERIOD_MS;
+  return next;
+}
+
 /**
  * Update some timer on every call
  */
@@ -139,16 +363,78 @@ void TrackrClass::printTime() {
   int min  = (state.totalMs - (hour*(3600*1000))) / (60*1000); 
   int sec  = (state.totalMs - (hour*(3600*1000)) - (min*(60*1000))) / 1000;
   int ms   = (state.totalMs % 1000);
-  _log.info("Time is : %d:%02d:%02d.%03d\n",hour,min,sec,ms);
+  _log.info("Time is : %d:%02d:%02d.%03d (rtc drift %d ppm)\n",hour,min,sec,ms,lowPowerService.getDriftPpm());
 }
 
 
+/**
+ * Debug commands, received on the serial line after the '!' prefix
+ *  - lower case : print a status or statistics, never change the device state
+ *  - upper case : act on the device, change a setting, access the module or run
+ *                 a self check / benchmark (they run on the device as the sketch
+ *                 has no host build)
+ * Keep trackrCommands in sync when adding a command, '?' lists it.
+ */
+static const char * trackrCommands[] = {
+  "?  this help",
+  "d  debug mode, no sleep (main loop)",
+  "c  config",
+  "l  log file",
+  "m  rtc memory layout",
+  "t  time",
+  "r  rf calibration stats",
+  "w  wisol power stats",
+  "u  uplink queue stats",
+  "q  uplink quota stats",
+  "k  failure counters",
+  "o  wake budget overruns",
+  "s  scan profile stats",
+  "g  geofence places",
+  "e  energy projection",
+  "C  clean the log file",
+  "S  switch to the next scan profile",
+  "T  toggle the scan trace recording",
+  "P  read the Sigfox PAK",
+  "F  frame codec self check",
+  "R  replay the scan trace",
+  "V  virtual fleet energy simulation",
+#if WISOL_TRANSPORT == WISOL_TRANSPORT_EMULATOR
+  "B  wisol emulator benchmark",
+  "D  wisol emulator deadline check",
+#endif
+};
+
 void TrackrClass::processCommands(char c) {
-  if ( c == '?' ) { _log.any("(c) 2018 Disk91.com\r\n"); }
-  if ( c == 'l' ) { _log.cat(); }
-  if ( c == 'C' ) { _log.any("Clean log file\n");_log.clean(); }
-  if ( c == 'P' ) { char buf[64]; wisolService.wakeUp(); wisolService.getSigfoxPakWithRetry(buf,64,3); _log.any("Sigfox PAK : %s\n",buf); wisolService.sleepMode(); }
+  // status
+  if ( c == '?' ) {
+    _log.any("(c) 2018 Disk91.com\r\n");
+    for ( unsigned int i = 0 ; i < sizeof(trackrCommands)/sizeof(trackrCommands[0]) ; i++ ) _log.any("!%s\r\n",trackrCommands[i]);
+  }
   if ( c == 'c' ) { configService.printConfig(); }
+  if ( c == 'l' ) { _log.cat(); }
+  if ( c == 'm' ) { rtcMemoryService.printLayout(); }
+  if ( c == 't' ) { printTime(); }
+  if ( c == 'r' ) { lowPowerService.printRfStats(); }
+  if ( c == 'w' ) { wisolService.printPowerStats(); }
+  if ( c == 'u' ) { uplinkQueueService.printStats(); }
+  if ( c == 'q' ) { quotaService.printStats(state.totalMs / 1000); }
+  if ( c == 'k' ) { countersService.printCounters(); }
+  if ( c == 'o' ) { printOverruns(); }
+  if ( c == 's' ) { wifiscanService.printStats(); }
+  if ( c == 'g' ) { geofenceService.printPlaces(); }
+  if ( c == 'e' ) { energyService.printProjection(); }
 
+  // actions
+  if ( c == 'C' ) { _log.any("Clean log file\n");_log.clean(); }
+  if ( c == 'S' ) { configService.setScanProfile((configService.config.scanProfile+1) % WIFISCAN_PROFILES); _log.any("Scan profile : %d\r\n",configService.config.scanProfile); }
+  if ( c == 'T' ) { configService.setTraceScans(!configService.config.traceScans); _log.any("Scan trace recording : %d\r\n",configService.config.traceScans); }
+  if ( c == 'P' ) { char buf[64]; wisolService.beginSession(); wisolService.getSigfoxPakWithRetry(buf,64,3); _log.any("Sigfox PAK : %s\n",buf); wisolService.endSession(); }
+  if ( c == 'F' ) { frameCodec.selfCheck(); }
+  if ( c == 'R' ) { wifiscanService.replayTrace(); }
+  if ( c == 'V' ) { energyService.printFleet(); }
+#if WISOL_TRANSPORT == WISOL_TRANSPORT_EMULATOR
+  if ( c == 'B' ) { wisolEmulator.runBenchmark(5); }
+  if ( c == 'D' ) { wisolEmulator.runDeadlineCheck(); }
+#endif
 }
 
@@ -27,27 +27,84 @@
 
 #include <Arduino.h>
 #include "config.h"
+#include "frame_codec.h"
+#include "wisol.h"
+
+#define TRACKR_STATE_VERSION  4       // RTC slot version of t_state
+#define TRACKR_MIN_SLEEP_MS   10000   // below this the next scheduled slot is skipped
+#define TRACKR_HISTORY_VERSION 1      // RTC slot version of t_history
+#define TRACKR_HEALTH_PERIOD_S (24*3600)  // health frame period
+
+// Wake-up phases, each one has to be over before its deadline (awake ms
+// since the start of execute()). The phases after the position are optional and
+// skipped once a deadline has been missed.
+#define TRACKR_PHASE_NONE      0
+#define TRACKR_PHASE_WAKE      1      // scan, config load & Wisol wake-up
+#define TRACKR_PHASE_POSITION  2
+#define TRACKR_PHASE_HISTORY   3
+#define TRACKR_PHASE_HEALTH    4
+#define TRACKR_PHASE_SENSORS   5      // rf policy temperature & voltage
+#define TRACKR_PHASES          6
+
+#define TRACKR_DEADLINE_WAKE_MS      10000
+#define TRACKR_DEADLINE_POSITION_MS  20000
+#define TRACKR_DEADLINE_HISTORY_MS   24000
+#define TRACKR_DEADLINE_HEALTH_MS    27000
+#define TRACKR_DEADLINE_SENSORS_MS   TRACKR_WAKE_BUDGET_MS
+#define TRACKR_SENSORS_MS            200     // expected duration of the sensors query
+
+#if TRACKR_DEADLINE_HEALTH_MS > TRACKR_WAKE_BUDGET_MS
+#error "The phase deadlines must be within TRACKR_WAKE_BUDGET_MS"
+#endif
+
+#if TRACKR_BATCH_SCANS < 1 || TRACKR_BATCH_SCANS > FRAME_MULTIFIX_MAX+1
+#error "TRACKR_BATCH_SCANS must be between 1 and FRAME_MULTIFIX_MAX+1"
+#endif
 
 typedef struct s_state {
       uint64_t  totalMs;
-      uint8_t tab[128];
-       
-      uint32_t  crc32;        // zone to store RTC crc32
+      uint32_t  wakes;          // wake-ups since power on
+      uint64_t  chargeNAh;      // estimated charge consumed since power on
+      uint32_t  awakeMs;        // awake time since power on, light sleep included
+      uint32_t  healthS;        // time of the last health frame, s since power on
+      uint16_t  overruns;       // wake-ups which missed a phase deadline
+      uint8_t   overrunPhase;   // TRACKR_PHASE_xx of the last missed deadline
+      uint8_t   overrunS;       // awake time in s when it was missed
 } t_state;
 
+typedef struct s_history {
+      uint8_t   count;          // scans recorded since the last transmission
+      uint8_t   pad[3];
+      t_frameFix fixes[FRAME_MULTIFIX_MAX];   // best AP of each scan, nic 000000 when none found
+} t_history;
+
 
 class TrackrClass {
 public:
   t_state state;
+  t_history history;
   
   bool init();
   void boot(uint32_t elapsedTime);
   void execute(uint32_t elapsedTime);
 
   void processCommands(char c);
+  uint32_t getNextSleepMs();
   
 protected:
   void printTime();
+  void recordScan();
+  void sendHistory(uint32_t nowS);
+  void sendHealth(t_wisolInfo * info, uint32_t nowS);
+  void accountEnergy(uint32_t sleepMs, uint32_t scanMs);
+  bool inTime(uint8_t phase, uint32_t needMs);
+  void printOverruns();
+
+  uint32_t wakeStartMs;         // wisolService.getAwakeMs() when execute() started
+  bool aborted;                 // a deadline has been missed, the optional phases are skipped
+
+  static uint32_t configTask(void * ctx);
+  static uint32_t bootConfigTask(void * ctx);
 
 };
 
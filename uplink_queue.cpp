@@ -0,0 +1,207 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Store and forward uplink queue
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+#include "uplink_queue.h"
+#include "wisol.h"
+#include "logger.h"
+#include "rtc_memory.h"
+#include "quota.h"
+#include "counters.h"
+
+UplinkQueueClass uplinkQueueService;
+
+/**
+ * Restore the queue from RTC memory, empty after a cold boot
+ */
+void UplinkQueueClass::restore() {
+  if ( ! rtcMemoryService.attach(RTC_SLOT_UPLINK, UPLINK_QUEUE_VERSION, &queue, sizeof(t_uplinkQueue)) ) {
+    memset(&queue,0,sizeof(t_uplinkQueue));
+  }
+  rtcMemoryService.setDirty(RTC_SLOT_UPLINK);
+}
+
+/**
+ * Send the new frame, the Wisol session must be open.
+ * When it fails the frame is queued, when it succeeds the module is working
+ * so the queued frames which back-off expired are retried.
+ * Frames refused by the daily quota are deferred when they are positions
+ * or alarms, dropped otherwise.
+ * nowS = seconds since power on
+ * Returns the sendRaw status of the new frame, UPLINK_STATUS_REFUSED when
+ * the quota refused it
+ */
+int UplinkQueueClass::send(uint8_t * frame, uint8_t len, uint8_t priority, uint32_t nowS) {
+  purge(nowS);
+  t_uplinkEntry fresh;
+  memcpy(fresh.frame,frame,len);
+  fresh.len = len;
+  fresh.attempts = 0;
+  fresh.createdS = nowS;
+  fresh.priority = priority;
+  if ( ! quotaService.admit(priority,nowS) ) {
+    if ( priority <= QUOTA_PRIO_POSITION ) {
+      fresh.nextTryS = nowS + UPLINK_BACKOFF_BASE_S;
+      enqueue(&fresh);
+    } else {
+      queue.dropped++;
+    }
+    rtcMemoryService.setDirty(RTC_SLOT_UPLINK);
+    return UPLINK_STATUS_REFUSED;
+  }
+  int status = transmit(&fresh,nowS);
+  if ( status == WISOL_STATUS_SEND_KO || status == WISOL_STATUS_NOT_SENT ) {
+    enqueue(&fresh);
+  } else {
+    // retry the oldest frames first
+    int retries = 0;
+    while ( retries < UPLINK_RETRY_PER_WAKE ) {
+      t_uplinkEntry * e = NULL;
+      for ( int i = 0 ; i < UPLINK_QUEUE_SZ ; i++ ) {
+        t_uplinkEntry * c = &queue.entries[i];
+        if ( c->createdS == 0 || c->nextTryS > nowS + UPLINK_BACKOFF_SLACK_S ) continue;
+        if ( e == NULL || c->createdS < e->createdS ) e = c;
+      }
+      if ( e == NULL || wisolService.getRemainingMs() < ENERGY_UPLINK_MS ) break;     // no time left in the wake-up budget
+      if ( ! quotaService.allows(e->priority,nowS) ) break;
+      retries++;
+      int r = transmit(e,nowS);
+      if ( r == WISOL_STATUS_SEND_KO || r == WISOL_STATUS_NOT_SENT ) break;
+      e->createdS = 0;
+    }
+    purge(nowS);
+  }
+  rtcMemoryService.setDirty(RTC_SLOT_UPLINK);
+  return status;
+}
+
+/**
+ * Number of frames waiting for a retry
+ */
+uint8_t UplinkQueueClass::pending() {
+  uint8_t n = 0;
+  for ( int i = 0 ; i < UPLINK_QUEUE_SZ ; i++ ) {
+    if ( queue.entries[i].createdS != 0 ) n++;
+  }
+  return n;
+}
+
+/**
+ * Failed transmissions since power on
+ */
+uint16_t UplinkQueueClass::getFailures() {
+  return queue.failures;
+}
+
+void UplinkQueueClass::printStats() {
+  uint32_t total = queue.sent + queue.failures;
+  _log.any("Uplinks : %d sent, %d failures (%d%% success), %d dropped, %d pending\r\n",
+            queue.sent, queue.failures, (total > 0)?(100*queue.sent)/total:100, queue.dropped, pending());
+  _log.any("Retried : %d, latency avg %ds max %ds\r\n",
+            queue.retried, (queue.retried > 0)?queue.latencySumS/queue.retried:0, queue.latencyMaxS);
+}
+
+// ==========================================================================
+// Internal functions
+
+/**
+ * Transmit one frame and update the metrics and the back-off on failure.
+ * A frame not started because of the wake-up deadline is not an attempt,
+ * it is due on the next wake-up. A delivered position supersedes the older
+ * queued ones.
+ */
+int UplinkQueueClass::transmit(t_uplinkEntry * e, uint32_t nowS) {
+  int status = wisolService.sendRaw(e->frame,e->len,false,NULL);
+  if ( status == WISOL_STATUS_NOT_SENT ) {
+    e->nextTryS = nowS;
+    return status;
+  }
+  e->attempts++;
+  if ( status == WISOL_STATUS_SEND_KO ) {
+    queue.failures++;
+    countersService.inc(COUNTER_SEND_KO);
+    uint32_t backoff = UPLINK_BACKOFF_BASE_S << ((e->attempts > 8)?8:e->attempts-1);
+    e->nextTryS = nowS + ((backoff > UPLINK_BACKOFF_MAX_S)?UPLINK_BACKOFF_MAX_S:backoff);
+    _log.info("Uplink failed (attempt %d), next try in %ds\r\n",e->attempts,e->nextTryS-nowS);
+  } else {
+    queue.sent++;
+    quotaService.record(nowS);
+    if ( e->priority == QUOTA_PRIO_POSITION ) supersede(e->createdS);
+    if ( e->attempts > 1 ) {
+      uint32_t latency = nowS - e->createdS;
+      queue.retried++;
+      queue.latencySumS += latency;
+      if ( latency > queue.latencyMaxS ) queue.latencyMaxS = latency;
+      _log.info("Queued uplink delivered after %d attempts, %ds\r\n",e->attempts,latency);
+    }
+  }
+  return status;
+}
+
+/**
+ * Queue a failed frame, the oldest frame is dropped when the queue is full
+ */
+void UplinkQueueClass::enqueue(t_uplinkEntry * fresh) {
+  t_uplinkEntry * e = NULL;
+  for ( int i = 0 ; i < UPLINK_QUEUE_SZ ; i++ ) {
+    t_uplinkEntry * c = &queue.entries[i];
+    if ( c->createdS == 0 ) { e = c; break; }
+    if ( e == NULL || c->createdS < e->createdS ) e = c;
+  }
+  if ( e->createdS != 0 ) {
+    queue.dropped++;
+    countersService.inc(COUNTER_UPLINK_DROP);
+  }
+  memcpy(e,fresh,sizeof(t_uplinkEntry));
+  if ( e->createdS == 0 ) e->createdS = 1;           // 0 marks a free entry
+}
+
+/**
+ * Drop the frames too old or retried too many times
+ */
+void UplinkQueueClass::purge(uint32_t nowS) {
+  for ( int i = 0 ; i < UPLINK_QUEUE_SZ ; i++ ) {
+    t_uplinkEntry * e = &queue.entries[i];
+    if ( e->createdS == 0 ) continue;
+    if ( nowS - e->createdS > UPLINK_MAX_AGE_S || e->attempts >= UPLINK_MAX_ATTEMPTS ) {
+      _log.info("Uplink dropped after %d attempts, age %ds\r\n",e->attempts,nowS - e->createdS);
+      e->createdS = 0;
+      queue.dropped++;
+      countersService.inc(COUNTER_UPLINK_DROP);
+    }
+  }
+}
+
+/**
+ * Drop the queued positions built before the given time : the payload has no
+ * age, the backend would take them for the current position
+ */
+void UplinkQueueClass::supersede(uint32_t createdS) {
+  for ( int i = 0 ; i < UPLINK_QUEUE_SZ ; i++ ) {
+    t_uplinkEntry * e = &queue.entries[i];
+    if ( e->createdS == 0 || e->priority != QUOTA_PRIO_POSITION || e->createdS >= createdS ) continue;
+    _log.info("Queued position dropped, superseded by a %ds newer one\r\n",createdS - e->createdS);
+    e->createdS = 0;
+    queue.dropped++;
+  }
+}
@@ -0,0 +1,84 @@
+/* ======================================================================
+    This file is part of disk91_tracker.
+
+    disk91_tracker is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+ */
+/* ======================================================================
+ *  Store and forward uplink queue
+ * ----------------------------------------------------------------------
+ * (c) Disk91.com - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ * Frames the Wisol failed to transmit are kept in RTC memory and retried
+ * on the next wake-ups with an exponential back-off.
+ */
+#ifndef UPLINK_QUEUE_H_
+#define UPLINK_QUEUE_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+#define UPLINK_QUEUE_VERSION      2         // RTC slot version of t_uplinkQueue
+#define UPLINK_QUEUE_SZ           3         // frames kept for retry
+#define UPLINK_FRAME_SZ           12        // max sigfox frame size
+#define UPLINK_MAX_AGE_S          (6*3600)  // older frames are dropped
+#define UPLINK_MAX_ATTEMPTS       5         // transmissions before dropping a frame
+#define UPLINK_BACKOFF_BASE_S     (SCHEDULER_PERIOD_MS/1000)  // first retry on the next wake-up
+#define UPLINK_BACKOFF_MAX_S      (4*3600)
+#define UPLINK_BACKOFF_SLACK_S    60        // wake-up jitter tolerated on the retry time
+#define UPLINK_RETRY_PER_WAKE     1         // queued frames retried after a successful uplink
+
+#define UPLINK_STATUS_REFUSED     0x10      // send() status : refused by the quota, deferred or dropped
+
+typedef struct s_uplinkEntry {
+      uint32_t  createdS;       // seconds since power on when the frame was built, 0 when free
+      uint32_t  nextTryS;       // no retry before this time
+      uint8_t   frame[UPLINK_FRAME_SZ];
+      uint8_t   len;
+      uint8_t   attempts;       // transmissions already done
+      uint8_t   priority;       // QUOTA_PRIO_xx
+      uint8_t   pad;
+} t_uplinkEntry;
+
+typedef struct s_uplinkQueue {
+      t_uplinkEntry entries[UPLINK_QUEUE_SZ];
+      uint16_t  sent;           // frames delivered
+      uint16_t  retried;        // frames delivered after at least one failure
+      uint16_t  failures;       // failed transmissions
+      uint16_t  dropped;        // frames dropped (age, attempts, queue full, quota or superseded)
+      uint32_t  latencySumS;    // sum of the delivery latency of the retried frames
+      uint32_t  latencyMaxS;
+} t_uplinkQueue;
+
+class UplinkQueueClass {
+public:
+  void restore();
+  int  send(uint8_t * frame, uint8_t len, uint8_t priority, uint32_t nowS);
+  uint8_t pending();
+  uint16_t getFailures();
+  void printStats();
+
+protected:
+  t_uplinkQueue queue;
+
+  int  transmit(t_uplinkEntry * e, uint32_t nowS);
+  void enqueue(t_uplinkEntry * fresh);
+  void purge(uint32_t nowS);
+  void supersede(uint32_t createdS);
+};
+
+extern UplinkQueueClass uplinkQueueService;
+
+#endif
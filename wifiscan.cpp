@@ -24,6 +24,14 @@
  */
 #include "wifiscan.h"
 #include "ESP8266WiFi.h"
+#include <FS.h>
+#include "low_power.h"
+#include "rtc_memory.h"
+#include "frame_codec.h"
+#include "counters.h"
+ extern "C" {
+   #include <user_interface.h>
+ }
 
 WifiScanClass wifiscanService;
 
@@ -47,34 +55,169 @@ static const char  ssidFiltered[WIFISCAN_SSIDFILTERLEN][16]= {
  * - Locally administred ( byte 0, bit 1) = 1
  */
 void WifiScanClass::startScan(uint32_t timeoutMs, uint8_t maxAp, boolean filtered) {
+    uint32_t d;
+    prepareScan(timeoutMs,maxAp,filtered);
+    while ( (d = scanStep()) != SCHEDULER_DONE ) delay(d);
+    printScan();
+}
 
-    // Init WiFi from sleep mode
-    WiFi.forceSleepWake();
-    WiFi.mode(WIFI_STA);  
-    
-    bool scanHidden=(filtered)?false:true;
+/**
+ * Set the scan parameters for the scanTask, see startScan for details
+ */
+void WifiScanClass::prepareScan(uint32_t timeoutMs, uint8_t maxAp, boolean filtered) {
+    if ( maxAp > WIFISCAN_MAX_AP ) maxAp = WIFISCAN_MAX_AP;
+    scanTimeoutMs = timeoutMs;
+    scanMaxAp = maxAp;
+    scanFiltered = filtered;
+    scanStepIdx = 0;
+    if ( ! rtcMemoryService.attach(RTC_SLOT_SCANPROF, WIFISCAN_PROFILE_VERSION, &profiles, sizeof(t_scanProfiles)) ) {
+      memset(&profiles,0,sizeof(t_scanProfiles));
+      profiles.profile = WIFISCAN_PROFILE;
+    }
+    rtcMemoryService.setDirty(RTC_SLOT_SCANPROF);
+}
 
-    WIFISCAN_LOG_DEBUG(("WiFi start scanning\r\n"));
-    uint32_t start = millis();
+uint32_t WifiScanClass::scanTask(void * ctx) {
+  return ((WifiScanClass *)ctx)->scanStep();
+}
 
-    if ( maxAp > WIFISCAN_MAX_AP ) maxAp = WIFISCAN_MAX_AP;
-    this->wifiFound = 0;
-    while ( (millis() - start) < timeoutMs && this->wifiFound < maxAp ) {
-      int n = WiFi.scanNetworks(false,scanHidden);
-      for(int i=0; i < n; i++){ 
-        if ( filtered && filtering(i) ) continue;
-        this->addWiFi(WiFi.BSSID(i),WiFi.RSSI(i),false);
-      }
+/**
+ * Scan as a sequence of non blocking steps, the scan passes are run asynchronously
+ * by the SDK and their completion is polled.
+ */
+uint32_t WifiScanClass::scanStep() {
+    switch ( scanStepIdx ) {
+      case 0:
+        {
+          // Init WiFi from sleep mode - the radio start latency depends on the RF calibration policy
+          radioStart = millis();
+          lowPowerService.rfPowerUp();
+          WiFi.forceSleepWake();
+          WiFi.mode(WIFI_STA);  
+          lowPowerService.recordScanLatency(millis() - radioStart);
+        }
+        scanStart = millis();
+        this->wifiFound = 0;
+        scanPass = 0;
+        traceLen = 0;
+        passUs = 0;
+        bssCount = 0;
+        passError = false;
+        traceFull = false;
+        startPass();
+        scanStepIdx = 1;
+        return WIFISCAN_POLL_MS;
+
+      case 1:
+        if ( ! scanPassDone && (millis() - scanStart) < scanTimeoutMs + WIFISCAN_PASS_MAX_MS ) return WIFISCAN_POLL_MS;
+        if ( ! scanPassDone ) {
+          passPending = false;                            // abandoned, its late callback is ignored
+          passError = true;
+        }
+        if ( scanPassDone && (millis() - scanStart) < scanTimeoutMs && this->wifiFound < WIFISCAN_MAX_AP && countRadios() < scanMaxAp ) {
+          startPass();
+          return WIFISCAN_POLL_MS;
+        }
+        scanMs = millis() - scanStart;
+        if ( this->wifiFound == 0 ) countersService.inc(COUNTER_SCAN_EMPTY);
+        updateStats();
+        WiFi.mode(WIFI_OFF);
+        WiFi.forceSleepBegin();
+        {
+          t_scanProfileStat * ps = &profiles.stats[profiles.profile];
+          uint8_t radios = countRadios();
+          ps->scans++;
+          ps->aps += this->wifiFound;
+          if ( radios >= 2 ) ps->fixes++;
+          lastRadioMs = millis() - radioStart;
+          ps->radioMs += lastRadioMs;
+        }
+        if ( profiles.trace ) writeTrace();
+        scanStepIdx = 2;
+        return 1;
+
+      default:
+        scanStepIdx = 0;
+        return SCHEDULER_DONE;
     }
-    WIFISCAN_LOG_DEBUG(("WiFi scanning duration %d ms, found %d WiFi\r\n",millis()-start,this->wifiFound));
+}
 
-    WiFi.mode(WIFI_OFF);
-    WiFi.forceSleepBegin();
-    delay(1);
+/**
+ * Start an asynchronous scan pass, the SDK calls scanDone with its result list
+ */
+void WifiScanClass::startPass() {
+  struct scan_config config;
+  memset(&config,0,sizeof(config));
+  config.show_hidden = ( scanFiltered )?0:1;
+  switch ( profiles.profile ) {
+    case WIFISCAN_PROFILE_HYBRID:
+      if ( scanPass > 0 ) {
+        config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+        config.scan_time.passive = WIFISCAN_PASSIVE_MS;
+        break;
+      }
+      // fall through - the first pass is a fast active one
+    case WIFISCAN_PROFILE_FAST:
+      config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+      config.scan_time.active.min = WIFISCAN_FAST_MIN_MS;
+      config.scan_time.active.max = WIFISCAN_FAST_MAX_MS;
+      break;
+    case WIFISCAN_PROFILE_PASSIVE:
+      config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+      config.scan_time.passive = WIFISCAN_PASSIVE_MS;
+      break;
+    default:
+      break;                                          // SDK default timings
+  }
+  scanPass++;
+  scanPassDone = false;
+  passPending = true;
+  if ( ! wifi_station_scan(&config,WifiScanClass::scanDone) ) {
+    passPending = false;
+    passError = true;
+    scanPassDone = true;
+  }
+}
+
+/**
+ * SDK scan completion callback, the APs are filtered and inserted directly
+ * from the SDK bss_info list : no copy in the Arduino core and no String.
+ * The callback of a pass abandoned on timeout is ignored, the scan results
+ * may already be in use. A failed pass is not recorded in the trace.
+ */
+void WifiScanClass::scanDone(void * arg, STATUS status) {
+  WifiScanClass * self = &wifiscanService;
+  if ( ! self->passPending || self->scanStepIdx != 1 ) return;
+  self->passPending = false;
+  uint32_t start = micros();
+  int n = 0;
+  uint8_t * count = NULL;
+  if ( status == OK && self->profiles.trace && self->traceLen + 7 <= WIFISCAN_TRACE_BUF_SZ ) {
+    // pass record, the bss count is updated with the bss records
+    uint8_t * p = &self->traceBuf[self->traceLen];
+    uint32_t now = millis();
+    p[0] = WIFISCAN_TRACE_MAGIC;
+    p[1] = ( self->scanPass == 1 )?WIFISCAN_TRACE_FIRST:0;
+    for ( int k = 0 ; k < 4 ; k++ ) p[2+k] = now >> (8*k);
+    p[6] = 0;
+    count = &p[6];
+    self->traceLen += 7;
+  }
+  if ( status == OK ) {
+    for ( struct bss_info * bss = (struct bss_info *)arg ; bss != NULL ; bss = STAILQ_NEXT(bss,next) ) {
+      n++;
+      if ( count != NULL ) self->traceBss(bss,count);
+      if ( self->scanFiltered && self->filtering(bss) ) continue;
+      self->addWiFi(bss->bssid,bss->rssi,bss->channel,false);
+    }
+  }
+  self->bssCount += n;
+  self->passUs += micros() - start;
+  self->scanPassDone = true;
 }
 
 /**
- * Indicate if the given index entry have to be filtered or not (true if it have to be filtered)
+ * Indicate if the given entry have to be filtered or not (true if it have to be filtered)
  * Filter conditions
  * - Multicast (byte0, bit 0) = 1 
  * - Locally administred ( byte 0, bit 1) = 1
@@ -82,10 +225,10 @@ void WifiScanClass::startScan(uint32_t timeoutMs, uint8_t maxAp, boolean filtere
  * - Full of 00 
  * - Full of FF
  */
-bool WifiScanClass::filtering(int index) {
+bool WifiScanClass::filtering(struct bss_info * bss) {
 
   // Test for Multicast, Locally Administred and Full of FF
-  uint8_t * mac = WiFi.BSSID(index);
+  uint8_t * mac = bss->bssid;
   uint8_t firstMacByte = mac[0];
   if ( (firstMacByte & 0x3) != 0 ) return true;
 
@@ -100,13 +243,17 @@ bool WifiScanClass::filtering(int index) {
   }
 
   // Test Hidden
-  if ( WiFi.isHidden(index) ) return true;
+  if ( bss->is_hidden ) return true;
 
-  // Test SSID 
-  String ssid = WiFi.SSID(index);
-  ssid.toLowerCase();
+  // Test SSID - case insensitive search of the keywords in place
+  int len = ( bss->ssid_len < sizeof(bss->ssid) )?bss->ssid_len:sizeof(bss->ssid);
   for (int i=0 ; i < WIFISCAN_SSIDFILTERLEN ; i++) {
-    if ( ssid.indexOf(ssidFiltered[i]) > -1 ) return true;
+    int kl = strlen(ssidFiltered[i]);
+    for ( int s = 0 ; s + kl <= len ; s++ ) {
+      int k = 0;
+      while ( k < kl && tolower(bss->ssid[s+k]) == ssidFiltered[i][k] ) k++;
+      if ( k == kl ) return true;
+    }
   }
 
   return false;
@@ -135,9 +282,11 @@ void WifiScanClass::printWiFi() {
 
 
 /**
- * Search in the WiFi list the two offering the best RSSI and copy the MAC
- * address into the given mac1 and mac2 buffer. each have to be a uint8_t[6]
- * buffer. Returns the number of Wifi information returned 0 / 1 / 2
+ * Search in the WiFi list the two offering the best RSSI smoothed over the
+ * previous scans and copy the MAC address into the given mac1 and mac2 buffer.
+ * The two MACs belong to different radios as Atlas needs 2 distinct points.
+ * each have to be a uint8_t[6] buffer. Returns the number of Wifi information
+ * returned 0 / 1 / 2
  */
 int WifiScanClass::getFirstAndSecondBestWiFi(uint8_t * mac1, uint8_t * mac2) {
   switch(this->wifiFound){
@@ -147,23 +296,377 @@ int WifiScanClass::getFirstAndSecondBestWiFi(uint8_t * mac1, uint8_t * mac2) {
       for (int k=0; k< 6 ; k++) mac1[k]=this->wifi[0].mac[k];
       return 1;
     default:
-      int best1=0; int8_t rss1=-128;
-      int best2=0; int8_t rss2=-128;
+      int best1=0; int16_t score1=-32768;
+      int best2=-1; int16_t score2=-32768;
       for (int i=0 ; i<this->wifiFound ; i++) {
-        if ( this->wifi[i].rssi >= rss1 ) {
-           best2 = best1;
-           rss2 = rss1;
-           best1 = i;  
-           rss1 = this->wifi[i].rssi;    
-        } else if ( this->wifi[i].rssi >= rss2 ) {
+        int16_t s = score(i);
+        if ( s > score1 ) {
+           best1 = i;
+           score1 = s;
+        }
+      }
+      for (int i=0 ; i<this->wifiFound ; i++) {
+        int16_t s = score(i);
+        if ( i != best1 && s > score2 && ! sameRadio(&this->wifi[best1],&this->wifi[i]) ) {
            best2 = i;
-           rss2 = this->wifi[i].rssi;
+           score2 = s;
         }
-        for (int k=0; k< 6 ; k++) mac1[k]=this->wifi[best1].mac[k];
-        for (int k=0; k< 6 ; k++) mac2[k]=this->wifi[best2].mac[k];
+      }
+      for (int k=0; k< 6 ; k++) mac1[k]=this->wifi[best1].mac[k];
+      if ( best2 < 0 ) {
+        WIFISCAN_LOG_DEBUG(("WiFi found are all the same radio\r\n"));
+        return 1;
+      }
+      for (int k=0; k< 6 ; k++) mac2[k]=this->wifi[best2].mac[k];
+
+      uint16_t pair = FrameCodecClass::macHash(mac1) ^ FrameCodecClass::macHash(mac2);
+      if ( pair != stats.pairHash ) {
+        stats.pairHash = pair;
+        if ( stats.pairChanges < 0xFFFF ) stats.pairChanges++;
       }
       return 2;
-  }  
+  }
+}
+
+/**
+ * Copy the MAC and RSSI of the Wifi offering the best RSSI
+ * Returns false when no Wifi has been found
+ */
+bool WifiScanClass::getBestWiFi(uint8_t * mac, int8_t * rssi) {
+  if ( this->wifiFound == 0 ) return false;
+  int best = 0;
+  for (int i=1 ; i<this->wifiFound ; i++) {
+    if ( this->wifi[i].rssi > this->wifi[best].rssi ) best = i;
+  }
+  for (int k=0; k< 6 ; k++) mac[k]=this->wifi[best].mac[k];
+  *rssi = this->wifi[best].rssi;
+  return true;
+}
+
+/**
+ * Access point found by the last scan, index < getApCount()
+ */
+t_wifiAp * WifiScanClass::getWiFi(int index) {
+  return &this->wifi[index];
+}
+
+/**
+ * Number of access points found by the last scan
+ */
+uint8_t WifiScanClass::getApCount() {
+  return this->wifiFound;
+}
+
+/**
+ * Log the result of the last scan. The scan task runs concurrently with the
+ * logger init, its logs are deferred to this call.
+ */
+void WifiScanClass::printScan() {
+  if ( passError ) WIFISCAN_LOG_ERROR(("WiFi scan pass not started or not completed\r\n"));
+  if ( traceFull ) WIFISCAN_LOG_WARN(("WiFi trace file full\r\n"));
+  WIFISCAN_LOG_DEBUG(("WiFi scanning duration %d ms, %d passes, %d bss processed in %d us\r\n",scanMs,scanPass,bssCount,passUs));
+  WIFISCAN_LOG_DEBUG(("WiFi found %d on %d radios\r\n",this->wifiFound,countRadios()));
+}
+
+/**
+ * Print the APs followed across the wake-ups and the pair stability
+ */
+void WifiScanClass::printStats() {
+  WIFISCAN_LOG_ANY(("WiFi pair changes : %d in %d scans\r\n",stats.pairChanges,stats.scans));
+  for ( int i = 0 ; i < WIFISCAN_PROFILES ; i++ ) {
+    t_scanProfileStat * ps = &profiles.stats[i];
+    if ( ps->scans == 0 ) continue;
+    WIFISCAN_LOG_ANY(("Profile %d%s : %d scans, %d ms/scan, %d AP/radio s, %d ms/fix\r\n",i,(i == profiles.profile)?"*":"",
+                      ps->scans,ps->radioMs/ps->scans,(uint32_t)((1000ULL*ps->aps)/((ps->radioMs > 0)?ps->radioMs:1)),
+                      (ps->fixes > 0)?ps->radioMs/ps->fixes:0));
+  }
+  for ( int i = 0 ; i < WIFISCAN_STATS_SZ ; i++ ) {
+    t_wifiStat * st = &stats.aps[i];
+    if ( st->hash == 0 ) continue;
+    WIFISCAN_LOG_ANY(("%04X : rssi %d presence %d misses %d\r\n",st->hash,st->rssiQ4/16,st->presence,st->misses));
+  }
+}
+
+/**
+ * Average radio on time of a scan with the current profile, 0 when not measured yet
+ */
+uint32_t WifiScanClass::getAvgScanMs() {
+  t_scanProfileStat * ps = &profiles.stats[profiles.profile];
+  return ( ps->scans > 0 )?ps->radioMs / ps->scans:0;
+}
+
+/**
+ * Percentage of the scans of the current profile with a fix, 100 before any scan
+ */
+uint8_t WifiScanClass::getFixPct() {
+  t_scanProfileStat * ps = &profiles.stats[profiles.profile];
+  return ( ps->scans > 0 )?(100UL * ps->fixes) / ps->scans:100;
+}
+
+/**
+ * Radio on time of the last scan
+ */
+uint32_t WifiScanClass::getLastScanMs() {
+  return lastRadioMs;
+}
+
+/**
+ * Select the profile and the trace recording of the next scans
+ */
+void WifiScanClass::setProfile(uint8_t profile, uint8_t trace) {
+  if ( profile < WIFISCAN_PROFILES ) profiles.profile = profile;
+  profiles.trace = trace;
+}
+
+/**
+ * Add a bss record to the trace buffer, ignored when the buffer is full
+ */
+void WifiScanClass::traceBss(struct bss_info * bss, uint8_t * count) {
+  uint8_t len = ( bss->ssid_len < sizeof(bss->ssid) )?bss->ssid_len:sizeof(bss->ssid);
+  if ( *count == 0xFF || traceLen + 10 + len > WIFISCAN_TRACE_BUF_SZ ) return;
+  uint8_t * p = &traceBuf[traceLen];
+  memcpy(p,bss->bssid,6);
+  p[6] = (uint8_t)bss->rssi;
+  p[7] = bss->channel;
+  p[8] = bss->is_hidden;
+  p[9] = len;
+  memcpy(&p[10],bss->ssid,len);
+  traceLen += 10 + len;
+  (*count)++;
+}
+
+/**
+ * Append the buffered passes of the scan to the trace file
+ */
+void WifiScanClass::writeTrace() {
+  if ( traceLen == 0 || ! SPIFFS.begin() ) return;
+  File f = SPIFFS.open(WIFISCAN_TRACE_FILE, "a");
+  if ( f ) {
+    if ( f.size() + traceLen <= WIFISCAN_TRACE_MAX_SIZE ) {
+      f.write(traceBuf,traceLen);
+    } else {
+      traceFull = true;
+    }
+    f.close();
+  }
+}
+
+/**
+ * Replay the trace file through the scan filtering, insertion and selection
+ * at full speed and report the throughput and the selection outcomes. The
+ * scan table and the statistics are restored at the end.
+ */
+void WifiScanClass::replayTrace() {
+  if ( ! SPIFFS.begin() ) return;
+  File f = SPIFFS.open(WIFISCAN_TRACE_FILE, "r");
+  if ( ! f ) {
+    WIFISCAN_LOG_ANY(("No WiFi trace\r\n"));
+    return;
+  }
+  attachStats();                                  // the real statistics are saved, not the ones restored by the replay
+  t_wifiStats savedStats;
+  memcpy(&savedStats,&stats,sizeof(t_wifiStats));
+  uint8_t savedFound = this->wifiFound;
+  t_wifiAp savedWifi[WIFISCAN_MAX_AP];
+  memcpy(savedWifi,this->wifi,sizeof(savedWifi));
+  bool savedFiltered = scanFiltered;
+  scanFiltered = true;
+  memset(&stats,0,sizeof(t_wifiStats));
+
+  uint32_t passes = 0, bssCount = 0, scans = 0;
+  uint32_t outcome[3] = { 0, 0, 0 };
+  uint32_t elapsedUs = 0;
+  uint8_t  hdr[7];
+  uint8_t  mac1[6], mac2[6];
+  struct bss_info bss;
+  bool inScan = false;
+  bool corrupted = false;
+  while ( ! corrupted && f.read(hdr,7) == 7 && hdr[0] == WIFISCAN_TRACE_MAGIC ) {
+    if ( (hdr[1] & WIFISCAN_TRACE_FIRST) && inScan ) {
+      uint32_t s = micros();
+      updateStats();
+      outcome[getFirstAndSecondBestWiFi(mac1,mac2)]++;
+      elapsedUs += micros() - s;
+      scans++;
+      inScan = false;
+    }
+    if ( ! inScan ) {
+      this->wifiFound = 0;
+      inScan = true;
+    }
+    passes++;
+    for ( int i = 0 ; i < hdr[6] ; i++ ) {
+      uint8_t rec[10];
+      if ( f.read(rec,10) != 10 || rec[9] > sizeof(bss.ssid) ) { corrupted = true; break; }
+      memset(&bss,0,sizeof(bss));
+      memcpy(bss.bssid,rec,6);
+      bss.rssi = (int8_t)rec[6];
+      bss.channel = rec[7];
+      bss.is_hidden = rec[8];
+      bss.ssid_len = rec[9];
+      if ( f.read(bss.ssid,bss.ssid_len) != bss.ssid_len ) { corrupted = true; break; }
+      bssCount++;
+      uint32_t s = micros();
+      if ( ! filtering(&bss) ) addWiFi(bss.bssid,bss.rssi,bss.channel,false);
+      elapsedUs += micros() - s;
+    }
+  }
+  if ( inScan ) {
+    uint32_t s = micros();
+    updateStats();
+    outcome[getFirstAndSecondBestWiFi(mac1,mac2)]++;
+    elapsedUs += micros() - s;
+    scans++;
+  }
+  f.close();
+  if ( corrupted ) WIFISCAN_LOG_WARN(("Replay : corrupted trace, stopped after %d passes\r\n",passes));
+  WIFISCAN_LOG_ANY(("Replay : %d scans, %d passes, %d bss in %d us (%d passes/s)\r\n",scans,passes,bssCount,elapsedUs,
+                    (elapsedUs > 0)?(uint32_t)((1000000ULL*passes)/elapsedUs):0));
+  WIFISCAN_LOG_ANY(("Replay : %d pairs, %d single AP, %d empty, %d pair changes\r\n",outcome[2],outcome[1],outcome[0],stats.pairChanges));
+
+  memcpy(&stats,&savedStats,sizeof(t_wifiStats));
+  this->wifiFound = savedFound;
+  memcpy(this->wifi,savedWifi,sizeof(savedWifi));
+  scanFiltered = savedFiltered;
+}
+
+/**
+ * Read the number of APs kept by the filter in each scan of the trace file,
+ * up to max scans. Used as the WiFi environment of the fleet simulation.
+ * Return the number of scans read, 0 without trace.
+ */
+uint16_t WifiScanClass::readTraceApCounts(uint8_t * counts, uint16_t max) {
+  if ( ! SPIFFS.begin() ) return 0;
+  File f = SPIFFS.open(WIFISCAN_TRACE_FILE, "r");
+  if ( ! f ) return 0;
+  uint16_t scans = 0;
+  uint8_t  hdr[7];
+  struct bss_info bss;
+  bool corrupted = false;
+  while ( ! corrupted && f.read(hdr,7) == 7 && hdr[0] == WIFISCAN_TRACE_MAGIC ) {
+    if ( hdr[1] & WIFISCAN_TRACE_FIRST ) {
+      if ( scans == max ) break;
+      counts[scans++] = 0;
+    }
+    for ( int i = 0 ; i < hdr[6] ; i++ ) {
+      uint8_t rec[10];
+      if ( f.read(rec,10) != 10 || rec[9] > sizeof(bss.ssid) ) { corrupted = true; break; }
+      memset(&bss,0,sizeof(bss));
+      memcpy(bss.bssid,rec,6);
+      bss.is_hidden = rec[8];
+      bss.ssid_len = rec[9];
+      if ( f.read(bss.ssid,bss.ssid_len) != bss.ssid_len ) { corrupted = true; break; }
+      if ( scans > 0 && ! filtering(&bss) && counts[scans-1] < 255 ) counts[scans-1]++;
+    }
+  }
+  f.close();
+  return scans;
+}
+
+/**
+ * Restore the statistics from RTC memory, a cold boot starts empty
+ */
+void WifiScanClass::attachStats() {
+  if ( ! rtcMemoryService.attach(RTC_SLOT_WIFISTATS, WIFISCAN_STATS_VERSION, &stats, sizeof(t_wifiStats)) ) {
+    memset(&stats,0,sizeof(t_wifiStats));
+  }
+  rtcMemoryService.setDirty(RTC_SLOT_WIFISTATS);
+}
+
+/**
+ * Selection score of a followed AP in 1/16 dB : smoothed RSSI plus a bonus
+ * for the APs seen in most of the scans
+ */
+static int16_t wifiStatScore(t_wifiStat * st) {
+  return st->rssiQ4 + st->presence * 16 / WIFISCAN_STATS_PRES_BONUS;
+}
+
+/**
+ * Update the RSSI and presence statistics of the APs with the last scan.
+ * The APs not seen for a while are forgotten. The scanned APs are processed
+ * strongest first as wifi[] is in the SDK order, a new AP replaces the AP
+ * with the lowest score not seen in this scan, when it scores better.
+ */
+void WifiScanClass::updateStats() {
+  attachStats();
+  stats.scans++;
+
+  for ( int i = 0 ; i < WIFISCAN_STATS_SZ ; i++ ) {
+    t_wifiStat * st = &stats.aps[i];
+    if ( st->hash == 0 ) continue;
+    st->presence -= st->presence >> WIFISCAN_STATS_PRES_SHIFT;
+    if ( ++st->misses > WIFISCAN_STATS_MAX_MISSES ) st->hash = 0;
+  }
+
+  uint8_t order[WIFISCAN_MAX_AP];
+  for ( int i = 0 ; i < this->wifiFound ; i++ ) {
+    int j = i;
+    while ( j > 0 && this->wifi[order[j-1]].rssi < this->wifi[i].rssi ) { order[j] = order[j-1]; j--; }
+    order[j] = i;
+  }
+
+  for ( int o = 0 ; o < this->wifiFound ; o++ ) {
+    t_wifiAp * ap = &this->wifi[order[o]];
+    uint16_t h = FrameCodecClass::macHash(ap->mac);
+    t_wifiStat * st = NULL;
+    t_wifiStat * victim = NULL;
+    for ( int k = 0 ; k < WIFISCAN_STATS_SZ ; k++ ) {
+      t_wifiStat * cand = &stats.aps[k];
+      if ( cand->hash == h ) { st = cand; break; }
+      if ( cand->hash != 0 && cand->misses == 0 ) continue;        // refreshed by this scan
+      if ( victim == NULL || ( victim->hash != 0 && ( cand->hash == 0 || wifiStatScore(cand) < wifiStatScore(victim) ) ) ) victim = cand;
+    }
+    if ( st == NULL ) {
+      int16_t newScore = ap->rssi * 16 + ( (255 >> WIFISCAN_STATS_PRES_SHIFT) * 16 ) / WIFISCAN_STATS_PRES_BONUS;
+      if ( victim == NULL || ( victim->hash != 0 && wifiStatScore(victim) >= newScore ) ) continue;
+      st = victim;
+      st->hash = h;
+      st->rssiQ4 = ap->rssi * 16;
+      st->presence = 0;
+    } else {
+      st->rssiQ4 += (ap->rssi * 16 - st->rssiQ4) >> WIFISCAN_STATS_RSSI_SHIFT;
+    }
+    st->presence += (255 - st->presence) >> WIFISCAN_STATS_PRES_SHIFT;
+    st->misses = 0;
+  }
+}
+
+/**
+ * Selection score of a scanned AP in 1/16 dB, see wifiStatScore()
+ */
+int16_t WifiScanClass::score(int index) {
+  uint16_t h = FrameCodecClass::macHash(this->wifi[index].mac);
+  for ( int k = 0 ; k < WIFISCAN_STATS_SZ ; k++ ) {
+    if ( stats.aps[k].hash == h ) return wifiStatScore(&stats.aps[k]);
+  }
+  return this->wifi[index].rssi * 16;
+}
+
+/**
+ * Returns true when the two BSSIDs are likely virtual APs of the same radio :
+ * same MAC except the last nibble or the locally administered bit, same
+ * channel and close RSSI
+ */
+bool WifiScanClass::sameRadio(t_wifiAp * a, t_wifiAp * b) {
+  if ( a->channel != b->channel || abs(a->rssi - b->rssi) > WIFISCAN_RADIO_RSSI_DELTA ) return false;
+  if ( (a->mac[0] & ~0x02) != (b->mac[0] & ~0x02) ) return false;
+  for ( int k = 1 ; k < 5 ; k++ ) {
+    if ( a->mac[k] != b->mac[k] ) return false;
+  }
+  return ( (a->mac[5] & 0xF0) == (b->mac[5] & 0xF0) );
+}
+
+/**
+ * Number of distinct radios in the WiFi list
+ */
+uint8_t WifiScanClass::countRadios() {
+  uint8_t n = 0;
+  for ( int i = 0 ; i < this->wifiFound ; i++ ) {
+    int j = 0;
+    while ( j < i && ! sameRadio(&this->wifi[i],&this->wifi[j]) ) j++;
+    if ( j == i ) n++;
+  }
+  return n;
 }
 
 /**
@@ -173,7 +676,7 @@ int WifiScanClass::getFirstAndSecondBestWiFi(uint8_t * mac1, uint8_t * mac2) {
  * When unicastOnly is true, only the MAC type unicast are added
  *  unicast is indicated by higher byte lower bit is 0
  */
-void WifiScanClass::addWiFi(uint8_t * _mac, int32_t _rssi, bool unicastOnly)
+void WifiScanClass::addWiFi(uint8_t * _mac, int32_t _rssi, uint8_t _channel, bool unicastOnly)
 {
   // filter the multicast addresses
   if ( unicastOnly && (_mac[0] & 0x01) == 0x01 ) return;
@@ -185,9 +688,10 @@ void WifiScanClass::addWiFi(uint8_t * _mac, int32_t _rssi, bool unicastOnly)
       this->wifi[this->wifiFound].mac[j] = _mac[j];
     }
     this->wifi[this->wifiFound].rssi = (int8_t)((_rssi < -128)?-128:_rssi);
+    this->wifi[this->wifiFound].channel = _channel;
     this->wifiFound++;
 
-  } else {
+  } else if ( entry != NULL ) {
     // update the Rssi if better
     if ( _rssi > entry->rssi ) {
         entry->rssi = (int8_t)((_rssi < -128)?-128:_rssi);
@@ -28,28 +28,134 @@
 
 #include <Arduino.h>
 #include "logger.h"
+#include "scheduler.h"
+ extern "C" {
+   #include <user_interface.h>
+ }
 
 #define WIFISCAN_LOG_LEVEL   5                    // 5 - Debug | 4 - Info | 3 - Warn | 2 - Error | 1 - Any | 0 - None
 #define WIFISCAN_MAX_AP     32
+#define WIFISCAN_POLL_MS    10                    // async scan completion polling period
+#define WIFISCAN_PASS_MAX_MS 3000                 // scan pass completion wait after the timeout
+
+#define WIFISCAN_RADIO_RSSI_DELTA 10              // max RSSI difference between the BSSIDs of a same radio
+
+#define WIFISCAN_FAST_MIN_MS      20              // active dwell time per channel of the fast profile
+#define WIFISCAN_FAST_MAX_MS      60
+#define WIFISCAN_PASSIVE_MS       120             // passive dwell time per channel, covers a 100 TU beacon period
+#define WIFISCAN_PROFILE_VERSION  3               // RTC slot version of t_scanProfiles
+
+// Scan trace file : a pass record per scan pass followed by its bss records
+//  pass : magic 0xA5, flags (bit 0 - first pass of a scan), millis() 4B little endian, bss count 1B
+//  bss  : bssid 6B, rssi 1B, channel 1B, hidden 1B, ssid length 1B, ssid
+#define WIFISCAN_TRACE_FILE       "/scans.trc"
+#define WIFISCAN_TRACE_MAX_SIZE   100000          // recording stops when the file reaches this size
+#define WIFISCAN_TRACE_BUF_SZ     1024            // passes of a scan are buffered then written at its end
+#define WIFISCAN_TRACE_MAGIC      0xA5
+#define WIFISCAN_TRACE_FIRST      0x01
+
+#define WIFISCAN_STATS_VERSION    1               // RTC slot version of t_wifiStats
+#define WIFISCAN_STATS_SZ         8               // APs followed across the wake-ups
+#define WIFISCAN_STATS_RSSI_SHIFT 2               // RSSI EWMA weight 1/4
+#define WIFISCAN_STATS_PRES_SHIFT 3               // presence EWMA weight 1/8
+#define WIFISCAN_STATS_MAX_MISSES 16              // scans without the AP before forgetting it
+#define WIFISCAN_STATS_PRES_BONUS 32              // presence 255 gives a 8 dB selection bonus
 
 typedef struct s_wifiAp {
     uint8_t   mac[6];
     int8_t    rssi;      
+    uint8_t   channel;
 } t_wifiAp;
 
+typedef struct s_wifiStat {
+    uint16_t  hash;         // FrameCodecClass::macHash(), 0 when free
+    int16_t   rssiQ4;       // smoothed RSSI in 1/16 dB
+    uint8_t   presence;     // smoothed presence, 255 when seen in every scan
+    uint8_t   misses;       // consecutive scans without the AP
+} t_wifiStat;
+
+typedef struct s_wifiStats {
+    t_wifiStat aps[WIFISCAN_STATS_SZ];
+    uint16_t  pairHash;     // hash of the last selected pair
+    uint16_t  pairChanges;  // selected pair changes
+    uint16_t  scans;
+    uint16_t  pad;
+} t_wifiStats;
+
+
+typedef struct s_scanProfileStat {
+    uint16_t  scans;
+    uint16_t  fixes;        // scans with 2 radios or more
+    uint32_t  aps;          // APs found
+    uint32_t  radioMs;      // radio on time including the start latency
+} t_scanProfileStat;
+
+typedef struct s_scanProfiles {
+    uint8_t   profile;      // profile of the next scans, from the config
+    uint8_t   trace;        // record the next scans in the trace file, from the config
+    uint8_t   pad[2];
+    t_scanProfileStat stats[WIFISCAN_PROFILES];
+} t_scanProfiles;
 
 class WifiScanClass {
 public:
   void startScan(uint32_t timeoutMs, uint8_t maxAp, boolean filtered);
   void printWiFi();
+  void printScan();
   int  getFirstAndSecondBestWiFi(uint8_t * mac1, uint8_t * mac2);
+  uint8_t getApCount();
+  bool getBestWiFi(uint8_t * mac, int8_t * rssi);
+  t_wifiAp * getWiFi(int index);
+  void printStats();
+  void setProfile(uint8_t profile, uint8_t trace);
+  uint32_t getAvgScanMs();
+  uint8_t getFixPct();
+  uint32_t getLastScanMs();
+  void replayTrace();
+  uint16_t readTraceApCounts(uint8_t * counts, uint16_t max);
+
+  // Cooperative scheduler steps
+  void prepareScan(uint32_t timeoutMs, uint8_t maxAp, boolean filtered);
+  static uint32_t scanTask(void * ctx);
   
 protected:
   uint8_t    wifiFound;
   t_wifiAp   wifi[WIFISCAN_MAX_AP];
 
-  void addWiFi(uint8_t * _mac, int32_t _rssi, bool unicastOnly);
-  bool filtering(int index);
+  uint8_t    scanStepIdx = 0;
+  uint32_t   scanStart;
+  uint32_t   scanTimeoutMs;
+  uint8_t    scanMaxAp;
+  bool       scanFiltered;
+  uint32_t   scanStep();
+  volatile bool scanPassDone;
+  volatile bool passPending = false;   // a pass is running, false once done or abandoned
+  uint8_t    scanPass;
+  uint32_t   radioStart;
+  uint32_t   lastRadioMs = 0;
+  // scan results kept for printScan(), the scan runs before the logger init
+  uint32_t   scanMs;
+  uint32_t   passUs;        // bss processing time of the passes
+  uint16_t   bssCount;
+  bool       passError;     // a pass did not start or was abandoned
+  bool       traceFull;
+  t_scanProfiles profiles;
+  uint8_t    traceBuf[WIFISCAN_TRACE_BUF_SZ];
+  uint16_t   traceLen;
+  void traceBss(struct bss_info * bss, uint8_t * count);
+  void writeTrace();
+  void startPass();
+  static void scanDone(void * arg, STATUS status);
+
+  t_wifiStats stats;
+  void attachStats();
+  void updateStats();
+  int16_t score(int index);
+
+  void addWiFi(uint8_t * _mac, int32_t _rssi, uint8_t _channel, bool unicastOnly);
+  bool sameRadio(t_wifiAp * a, t_wifiAp * b);
+  uint8_t countRadios();
+  bool filtering(struct bss_info * bss);
   t_wifiAp * searchForWiFi(uint8_t * _mac);
 };
 
@@ -30,10 +30,18 @@
    #include "tool.h"
  }
  #include "config.h"
- #include "SoftwareSerial.h"
+ #include "rtc_memory.h"
+ #include "wisol_transport.h"
+ #include "counters.h"
+ #if WISOL_LIGHT_SLEEP > 0
+ #include <ESP8266WiFi.h>
+ extern "C" {
+   #include <user_interface.h>
+   #include <gpio.h>
+ }
+ #endif
  
  WisolClass wisolService;
- SoftwareSerial swSer1(WISOL_RX_PIN, WISOL_TX_PIN, false, 64);       // RX, TX, Invert, Buffer Size
 
  /**
   * Init the communication with Wisol.
@@ -42,7 +50,7 @@
  bool WisolClass::init() {
   if ( ! ready ) {
     WISOL_LOG_INFO(("Init Wisol\r\n"));
-    swSer1.begin(9600);
+    wisolTransport.begin();
     delay(10);
     flushRxLine();
     ready = true;
@@ -54,12 +62,45 @@
  * Reset the wisol chip
  */
 bool WisolClass::reset() {
-  sendLine("AT$P=0\r");
-  delay(1000);
-  flushRxLine();
+  uint32_t d;
+  while ( (d = resetStep()) != SCHEDULER_DONE ) delay(d);
   return true;
  }
 
+/**
+ * Reset as a sequence of non blocking steps
+ */
+uint32_t WisolClass::resetStep() {
+  uint32_t d;
+  switch ( resetStepIdx ) {
+    case 0:
+      startLine("AT$P=0\r");
+      resetStepIdx++;
+      // no break - start sending
+    case 1:
+      if ( (d = txStep()) > 0 ) return d;
+      startRx(WISOL_WAIT_RESET_MS);
+      resetStepIdx++;
+      return WISOL_RX_POLL_MS;
+    default:
+      // module is ready when it acknowledges the reset
+      d = rxStep();
+      if ( d == WISOL_RX_PENDING || ( d == WISOL_RX_LINE && strcmp(rxBuf,"OK") != 0 ) ) return WISOL_RX_POLL_MS;
+      if ( d == WISOL_RX_TIMEOUT ) {
+        WISOL_LOG_WARN(("Wisol reset not acknowledged\r\n"));
+      }
+      flushRxLine();
+      if ( power.resets < 0xFFFF ) power.resets++;
+      setPowerState(WISOL_POWER_AWAKE);
+      resetStepIdx = 0;
+      return SCHEDULER_DONE;
+  }
+}
+
+uint32_t WisolClass::resetTask(void * ctx) {
+  return ((WisolClass *)ctx)->resetStep();
+}
+
 
 
 /**
@@ -93,18 +134,28 @@ bool WisolClass::isSleeping() {
 bool WisolClass::sleepMode() {
   char buf[100];
 
+  if ( power.state == WISOL_POWER_SLEEPING ) {
+    if ( power.skipped < 0xFFFF ) power.skipped++;
+    return true;
+  }
   WISOL_LOG_INFO(("Wisol - request sleeping\r\n"));
   sendLine("AT$P=1\r");   // /!\ Note = if you add a LF (\n) at end of this command the redive returns OK but don't switch to sleep mode
   if ( readLine(buf,100,WISOL_WAIT_STD_TIME_MS,false) ) {
     if ( strcmp(buf,"OK") == 0 ) {
       WISOL_LOG_WARN(("wisol sleep request applied\r\n"));
+      if ( power.sleeps < 0xFFFF ) power.sleeps++;
+      power.failures = 0;
+      setPowerState(WISOL_POWER_SLEEPING);
       return true;
     } else {
       WISOL_LOG_DEBUG(("wisol sleep request returned : %s\r\n",buf));
+      setPowerState(WISOL_POWER_UNKNOWN);
       return false;
     }
   } else {
-    // If not responding, looks strange
+    // If not responding, looks strange - reset it on next wake-up after some failures
+    if ( power.failures < 0xFF ) power.failures++;
+    setPowerState( (power.failures >= 2)?WISOL_POWER_NEEDS_RESET:WISOL_POWER_UNKNOWN );
     return false;
   }
 }
@@ -115,15 +166,293 @@ bool WisolClass::sleepMode() {
  * Break is LOW on tx durring ??? 
  */
 void WisolClass::wakeUp() {
-  WISOL_LOG_INFO(("Wisol - waking up\r\n"));
-  init();
-  digitalWrite(WISOL_TX_PIN,LOW);
-  delay(5);
-  digitalWrite(WISOL_TX_PIN,HIGH);
-  delay(20);
-  flushRxLine();                         
+  uint32_t d;
+  while ( (d = wakeUpStep()) != SCHEDULER_DONE ) delay(d);
+}
+
+/**
+ * Wake up as a sequence of non blocking steps
+ */
+uint32_t WisolClass::wakeUpStep() {
+  switch ( wakeUpStepIdx ) {
+    case 0:
+      if ( power.state == WISOL_POWER_AWAKE ) {
+        if ( power.skipped < 0xFFFF ) power.skipped++;
+        return SCHEDULER_DONE;
+      }
+      WISOL_LOG_INFO(("Wisol - waking up\r\n"));
+      init();
+      wisolTransport.setBreak(true);
+      wakeUpStepIdx++;
+      return 5;
+    case 1:
+      wisolTransport.setBreak(false);
+      wakeUpStepIdx++;
+      return 20;
+    case 2:
+      flushRxLine();                         
+      if ( power.wakeUps < 0xFFFF ) power.wakeUps++;
+      if ( power.state == WISOL_POWER_NEEDS_RESET ) {
+        // previous transitions failed, chain a reset
+        wakeUpStepIdx++;
+        return 1;
+      }
+      setPowerState(WISOL_POWER_AWAKE);
+      wakeUpStepIdx = 0;
+      return SCHEDULER_DONE;
+    default:
+      {
+        uint32_t d = resetStep();
+        if ( d != SCHEDULER_DONE ) return d;
+      }
+      power.failures = 0;
+      wakeUpStepIdx = 0;
+      return SCHEDULER_DONE;
+  }
+}
+
+uint32_t WisolClass::wakeUpTask(void * ctx) {
+  return ((WisolClass *)ctx)->wakeUpStep();
+}
+
+
+// ==========================================================================
+// Batched queries
+
+static const char * wisolQueryCmd[WISOL_QUERY_FIELDS] = { "AT$I=10\r", "AT$I=11\r", "AT$T?\r", "AT$V?\r" };
+
+/**
+ * Query several information in one session. The commands of the requested fields
+ * (WISOL_QUERY_xx bit mask) are sent back to back and the responses are parsed in
+ * order while the next command is transmitted. Failed fields are sent again, up
+ * to retry passes. The info struct indicates the fields read successfully.
+ * A response which does not fit its field ends the pass : the following ones
+ * are not trusted as a lost line would shift them to the wrong fields.
+ * Return true when all the requested fields are valid.
+ */
+bool WisolClass::query(t_wisolInfo * info, uint8_t fields, int retry) {
+  uint8_t pending[WISOL_QUERY_FIELDS];
+  info->requested = fields;
+  info->valid = 0;
+  info->sigfoxId = 0;
+  info->pak[0] = '\0';
+  info->temperature = WISOL_INVALID_TEMPERATURE;
+  info->voltage = WISOL_INVALID_VOLTAGE;
+
+  while ( retry > 0 && info->valid != fields ) {
+    // list the fields to query in this pass
+    uint8_t n = 0, got = 0;
+    bool shifted = false;
+    for ( uint8_t f = 0 ; f < WISOL_QUERY_FIELDS ; f++ ) {
+      if ( (fields & (1 << f)) && !(info->valid & (1 << f)) ) pending[n++] = f;
+    }
+
+    // pipeline the commands, collecting the responses on the fly
+    flushRxLine();
+    startRx(WISOL_WAIT_STD_TIME_MS);
+    for ( uint8_t i = 0 ; i < n ; i++ ) {
+      uint32_t d;
+      startLine(wisolQueryCmd[pending[i]]);
+      while ( (d = txStep()) > 0 ) {
+        uint32_t s = millis();
+        while ( (millis() - s) < d ) {
+          if ( ! shifted && got < n && rxStep() == WISOL_RX_LINE ) {
+            shifted = ! parseQuery(info,pending[got++],rxBuf);
+          }
+          delay(1);
+        }
+      }
+      rxDeadline = millis() + WISOL_WAIT_STD_TIME_MS;   // timeout is counted from the last command
+    }
+    while ( ! shifted && got < n ) {
+      int r = rxStep();
+      if ( r == WISOL_RX_TIMEOUT ) break;
+      if ( r == WISOL_RX_LINE ) {
+        shifted = ! parseQuery(info,pending[got++],rxBuf);
+        rxDeadline = millis() + WISOL_WAIT_STD_TIME_MS;
+      } else {
+        delay(1);
+      }
+    }
+    if ( shifted ) {
+      WISOL_LOG_WARN(("Unexpected response from Wisol (%d/%d)\r\n",got,n));
+      delay(WISOL_WAIT_STD_TIME_MS);                    // the late responses are flushed by the next pass
+    } else if ( got < n ) {
+      WISOL_LOG_WARN(("No response from Wisol (%d/%d)\r\n",got,n));
+      countersService.inc(COUNTER_WISOL_TIMEOUT);
+    }
+    retry--;
+    if ( retry > 0 && info->valid != fields ) delay(10);
+  }
+  return ( info->valid == fields );
+}
+
+/**
+ * Read a 4 digits decimal response, with an optional sign, within [min,max]
+ */
+static bool wisolDecValue(char * line, int len, int16_t min, int16_t max, int16_t * v) {
+  int digits = ( line[0] == '-' )?len-1:len;
+  if ( digits != 4 ) return false;
+  for ( int i = len-4 ; i < len ; i++ ) {
+    if ( line[i] < '0' || line[i] > '9' ) return false;
+  }
+  int16_t r = dsk_convertDecChar4Int(line);
+  if ( r < min || r > max ) return false;
+  *v = r;
+  return true;
+}
+
+/**
+ * Parse a response line for the given field (index of the WISOL_QUERY_xx bit)
+ * Return false when the line is not a response to this field
+ */
+bool WisolClass::parseQuery(t_wisolInfo * info, uint8_t field, char * line) {
+  if ( strncmp(line,"ERROR:",6) == 0 ) {
+    WISOL_LOG_DEBUG(("Wisol serial err\r\n"));
+    countersService.inc(COUNTER_WISOL_ERROR);
+    return true;
+  }
+  int len = strlen(line);
+  int16_t v;
+  switch ( 1 << field ) {
+    case WISOL_QUERY_ID:
+      if ( len == 8 && dsk_isHexString(line,8,false) ) {
+        info->sigfoxId = dsk_convertHexChar8Int(line);
+        info->valid |= WISOL_QUERY_ID;
+      } else {
+        WISOL_LOG_WARN(("Invalid response (ID) from Wisol\r\n"));
+        return false;
+      }
+      break;
+    case WISOL_QUERY_PAK:
+      if ( len == 16 && dsk_isHexString(line,len,true) ) {
+        strcpy(info->pak,line);
+        info->valid |= WISOL_QUERY_PAK;
+      } else {
+        WISOL_LOG_WARN(("Invalid response (PAK) from Wisol\r\n"));
+        return false;
+      }
+      break;
+    case WISOL_QUERY_TEMP:
+      WISOL_LOG_DEBUG(("Wisol Temperature : %s\r\n",line));
+      if ( ! wisolDecValue(line,len,WISOL_TEMPERATURE_MIN,WISOL_TEMPERATURE_MAX,&v) ) return false;
+      info->temperature = v;
+      info->valid |= WISOL_QUERY_TEMP;
+      break;
+    case WISOL_QUERY_VOLT:
+      WISOL_LOG_DEBUG(("Wisol Volt : %s\r\n",line));
+      if ( ! wisolDecValue(line,len,WISOL_VOLTAGE_MIN,WISOL_VOLTAGE_MAX,&v) ) return false;
+      info->voltage = v;
+      info->valid |= WISOL_QUERY_VOLT;
+      break;
+  }
+  return true;
+}
+
+// ==========================================================================
+// Power state tracking
+
+/**
+ * Attach the power state to its RTC slot, the state is unknown after a cold boot.
+ * Day is the current day index used for the daily transition counters.
+ */
+void WisolClass::restorePowerState(uint16_t day) {
+  if ( ! rtcMemoryService.attach(RTC_SLOT_WISOL, WISOL_POWER_VERSION, &power, sizeof(t_wisolPower)) ) {
+    memset(&power,0,sizeof(t_wisolPower));
+    power.state = WISOL_POWER_UNKNOWN;
+    power.day = day;
+  }
+  if ( power.day != day ) {
+    power.prevDay = power.wakeUps + power.sleeps + power.resets;
+    power.wakeUps = 0;
+    power.sleeps = 0;
+    power.resets = 0;
+    power.skipped = 0;
+    power.day = day;
+  }
+  sessionDepth = 0;
+  uplinkMs = 0;
+  uplinkSleptMs = 0;
+  rtcMemoryService.setDirty(RTC_SLOT_WISOL);
+}
+
+/**
+ * Consecutive power transitions the module did not answer
+ */
+uint8_t WisolClass::getPowerFailures() {
+  return power.failures;
+}
+
+/**
+ * Time spent in uplinks since the wake-up, including the light sleep
+ */
+uint32_t WisolClass::getUplinkMs() {
+  return uplinkMs;
+}
+
+uint32_t WisolClass::getUplinkSleptMs() {
+  return uplinkSleptMs;
+}
+
+/**
+ * Bound the response waits so they end before the given awake time
+ * (getAwakeMs()), 0 removes the bound. The commands started after the
+ * deadline time out at once.
+ */
+void WisolClass::setDeadline(uint32_t awakeMs) {
+  deadlineMs = awakeMs;
+}
+
+/**
+ * Time since the ESP wake-up, light sleep of the uplinks included
+ */
+uint32_t WisolClass::getAwakeMs() {
+  return millis() + uplinkSleptMs;
+}
+
+/**
+ * Time left before the deadline, 0xFFFFFFFF when there is none
+ */
+uint32_t WisolClass::getRemainingMs() {
+  if ( deadlineMs == 0 ) return 0xFFFFFFFF;
+  uint32_t now = getAwakeMs();
+  return ( now < deadlineMs )?deadlineMs - now:0;
+}
+
+/**
+ * Start an AT session, the module is woken up only if not already awake.
+ * Sessions can be nested, the module goes back to sleep at the end of the
+ * outer session so several commands share the same awake window.
+ */
+void WisolClass::beginSession() {
+  if ( sessionDepth == 0 ) wakeUp();
+  sessionDepth++;
+}
+
+void WisolClass::endSession() {
+  if ( sessionDepth > 0 ) sessionDepth--;
+  if ( sessionDepth == 0 ) sleepMode();
+}
+
+/**
+ * Number of power transitions (wake-up, sleep, reset) done today
+ */
+uint16_t WisolClass::getTransitionsToday() {
+  return power.wakeUps + power.sleeps + power.resets;
 }
 
+void WisolClass::printPowerStats() {
+  const char * states[] = { "unknown", "sleeping", "awake", "needs reset" };
+  WISOL_LOG_ANY(("-------- Wisol power --------\r\n"));
+  WISOL_LOG_ANY((" State : %s\r\n",states[power.state & 3]));
+  WISOL_LOG_ANY((" Today : %d wake-ups, %d sleeps, %d resets, %d skipped\r\n",power.wakeUps,power.sleeps,power.resets,power.skipped));
+  WISOL_LOG_ANY((" Yesterday : %d transitions\r\n",power.prevDay));
+}
+
+void WisolClass::setPowerState(uint8_t state) {
+  power.state = state;
+  rtcMemoryService.setDirty(RTC_SLOT_WISOL);
+}
 
 /**
  * Send a message to Sigfox of the indicated len.
@@ -134,12 +463,17 @@ void WisolClass::wakeUp() {
  *   WISOL_STATUS_SEND_OK => Frame transmitted
  *   WISOL_STATUS_NO_DONWLINK => Frame transmitted, no downlink response
  *   WISOL_STATUS_DOWNLINK => Frame trasnmitted, downlink response received
+ *   WISOL_STATUS_NOT_SENT => Frame not transmitted, the wake-up deadline has passed
  *   
  * Rq : Downlink feature are not yet implemented
  */
 int WisolClass::sendRaw(uint8_t * frame, int len, bool withDownlink, uint8_t * downlink) {
 
   if ( len > 12 ) return WISOL_STATUS_SEND_KO;
+  if ( getRemainingMs() == 0 ) {
+    WISOL_LOG_WARN(("Wisol uplink not started, wake-up deadline passed\r\n"));
+    return WISOL_STATUS_NOT_SENT;
+  }
  
   char msg[25];
   dsk_convertIntTab2Hex(msg,frame,len,true);
@@ -147,8 +481,29 @@ int WisolClass::sendRaw(uint8_t * frame, int len, bool withDownlink, uint8_t * d
    char cmd[128];
    sprintf(cmd,"AT$SF=%s\r",msg); 
    WISOL_LOG_DEBUG(("Wisol is sending the following command : [%s]\r\n",cmd));
+   uint32_t start = millis();
    sendLine(cmd);
-   if ( readLine(cmd,128,WISOL_WAIT_UPLINK_MS,false) ) {
+   uint32_t txMs = millis() - start;
+   uint32_t sleptMs = 0;
+   bool woken = false;                            // the ESP was woken up from light sleep by the answer
+   #if WISOL_LIGHT_SLEEP > 0
+     sleptMs = waitRxLightSleep(clipWait(WISOL_WAIT_UPLINK_MS),&woken);
+     uplinkSleptMs += sleptMs;
+   #endif
+   memset(cmd,0,sizeof(cmd));
+   uint32_t readMs = ( sleptMs < WISOL_WAIT_UPLINK_MS )?WISOL_WAIT_UPLINK_MS - sleptMs:1;
+   bool received = readLine(cmd,128,( woken )?WISOL_WAIT_WOKEN_MS:readMs,false);
+   uint32_t awakeMs = millis() - start;           // millis() does not count the light sleep
+   uplinkMs += awakeMs + sleptMs;
+   WISOL_LOG_INFO(("Uplink over %s : tx %d ms, response %d ms, cpu %d ms\r\n",wisolTransport.name(),txMs,awakeMs+sleptMs-txMs,awakeMs));
+   if ( woken && ( received || cmd[0] != '\0' ) && strstr(cmd,"RR") == NULL ) { // "ERROR" with its first char possibly lost
+      // The chars received while the UART restarts after the wake-up are lost, up to the "OK" :
+      // the module only answers once the frame is transmitted, so any answer but an error is
+      // a success. A silent module still fails.
+      if ( strcmp(cmd,"OK") != 0 ) WISOL_LOG_DEBUG(("Wisol uplink answer lost on wake-up (%s)\r\n",cmd));
+      return WISOL_STATUS_SEND_OK;
+   }
+   if ( received ) {
       if ( strcmp(cmd,"OK") == 0 ) {
         return WISOL_STATUS_SEND_OK;
       } else {
@@ -172,20 +527,13 @@ int WisolClass::sendRaw(uint8_t * frame, int len, bool withDownlink, uint8_t * d
  * Return true when success
  */
 bool WisolClass::getSigfoxPak(char * buf, int sz) {
-  bool ret = false;
-  sendLine("AT$I=11\r");
-  if ( readLine(buf,sz,WISOL_WAIT_STD_TIME_MS,false) ) {
-    if ( strlen(buf) == 16 && dsk_isHexString(buf,strlen(buf),true) ) {
-      ret = true;
-    } else {
-      WISOL_LOG_WARN(("Invalid response (PAK) from Wisol\r\n"));
-    }
-  } else {
-    WISOL_LOG_WARN(("No response (PAK) from Wisol\r\n"));
-    ret = false;
+  t_wisolInfo info;
+  if ( query(&info,WISOL_QUERY_PAK,1) ) {
+    strncpy(buf,info.pak,sz-1);
+    buf[sz-1] = '\0';
+    return true;
   }
-  
-  return ret;
+  return false;
 }
 
 /**
@@ -203,23 +551,8 @@ bool WisolClass::getSigfoxPakWithRetry(char * buf, int sz,int retry) {
  * Return 0 in case of error
  */
 uint32_t WisolClass::getSigfoxId() {
-  char buf[32];
-  uint32_t ret;
-
-  sendLine("AT$I=10\r");
-  if ( readLine(buf,32,WISOL_WAIT_STD_TIME_MS,false) ) {
-     if ( strlen(buf) == 8 && dsk_isHexString(buf,8,false) ){
-       ret = dsk_convertHexChar8Int(buf);
-     } else {
-      WISOL_LOG_WARN(("Invalid response (ID) from Wisol\r\n"));
-      ret = 0;
-     }
-  } else {
-    WISOL_LOG_WARN(("No response (ID) from Wisol\r\n"));
-    ret = 0;
-  }
-
-  return ret;
+  t_wisolInfo info;
+  return ( query(&info,WISOL_QUERY_ID,1) )?info.sigfoxId:0;
 }
 
 /**
@@ -238,18 +571,8 @@ uint32_t WisolClass::getSigfoxIdWithRetry(int retry) {
  * In case of error the result is -300 (INVALID_TEMPERATURE)
  */
 int16_t WisolClass::getTemperature() {
-  char buf[100];
-  sendLine("AT$T?\r");
-  if ( readLine(buf,100,WISOL_WAIT_STD_TIME_MS,false) ) {
-    int16_t temp = -300;
-    if ( strlen(buf) >= 4 ) {
-      temp = dsk_convertDecChar4Int(buf);
-    }
-    WISOL_LOG_DEBUG(("Wisol Temperature : %s -- %d\r\n",buf,temp));
-    return temp;
-  } else {
-    return WISOL_INVALID_TEMPERATURE;
-  }
+  t_wisolInfo info;
+  return ( query(&info,WISOL_QUERY_TEMP,1) )?info.temperature:WISOL_INVALID_TEMPERATURE;
 }
 
 /**
@@ -266,18 +589,8 @@ uint16_t WisolClass::getTemperatureWithRetry(int retry) {
  * Return the Wisol voltage in mV. In case of error 0 is returned
  */
 uint16_t WisolClass::getVoltage() {
-  char buf[100];
-  sendLine("AT$V?\r");
-  if ( readLine(buf,100,WISOL_WAIT_STD_TIME_MS,false) ) {
-    uint16_t volt = 0;
-    if ( strlen(buf) >= 4 ) {
-      volt = dsk_convertDecChar4Int(buf);
-    }
-    WISOL_LOG_DEBUG(("Wisol Volt : %s -- %d\r\n",buf,volt));
-    return volt;
-  } else {
-    return WISOL_INVALID_VOLTAGE;
-  }
+  t_wisolInfo info;
+  return ( query(&info,WISOL_QUERY_VOLT,1) )?info.voltage:WISOL_INVALID_VOLTAGE;
 }
 /**
  * Same as getTemperature but make retry in case of communication error 
@@ -292,23 +605,133 @@ uint16_t WisolClass::getVoltageWithRetry(int retry) {
 // ==========================================================================
 // Internal functions
 
+#if WISOL_LIGHT_SLEEP > 0
+static volatile bool wisolLightSleepWoken;
+static volatile bool wisolLightSleepRxWoken;
+static uint8_t wisolLightSleepRxPin;
+
+static void wisolLightSleepWakeUp() {
+  // the timer and the GPIO share this callback, only a start bit on the RX line
+  // or a received char make it a wake-up by the module
+  wisolLightSleepRxWoken = ( GPIO_INPUT_GET(GPIO_ID_PIN(wisolLightSleepRxPin)) == 0 || wisolTransport.available() > 0 );
+  wisolLightSleepWoken = true;
+}
+
+/**
+ * Wait for the module to start answering with the ESP in forced light sleep.
+ * The CPU is woken up by the start bit of the first char on the transport RX pin or
+ * by the timeout. WiFi must be off. The RTC clock is used to measure the sleep
+ * as millis() is not running during light sleep.
+ * rxWoken is set when the module activity woke the ESP up, not the timer.
+ * Return the time spent in light sleep, 0 when the ESP did not sleep.
+ */
+uint32_t WisolClass::waitRxLightSleep(uint32_t maxMs, bool * rxWoken) {
+  *rxWoken = false;
+  if ( wisolTransport.available() ) return 0;
+
+  uint32_t rtcStart = system_get_rtc_time();
+  wisolLightSleepWoken = false;
+  wisolLightSleepRxWoken = false;
+  wisolLightSleepRxPin = wisolTransport.rxPin();
+  wifi_fpm_do_wakeup();                                   // leave the modem forced sleep
+  wifi_fpm_close();
+  wifi_set_opmode_current(NULL_MODE);
+  wifi_fpm_set_sleep_type(LIGHT_SLEEP_T);
+  wifi_fpm_open();
+  gpio_pin_wakeup_enable(GPIO_ID_PIN(wisolTransport.rxPin()), GPIO_PIN_INTR_LOLEVEL);
+  wifi_fpm_set_wakeup_cb(wisolLightSleepWakeUp);
+  wifi_fpm_do_sleep(maxMs * 1000);
+  // the CPU stops in the delay, the loop exits right after the wake-up
+  uint32_t slices = maxMs / WISOL_LIGHT_SLEEP_SLICE_MS + 1;
+  while ( ! wisolLightSleepWoken && slices > 0 ) {
+    delay(WISOL_LIGHT_SLEEP_SLICE_MS);
+    slices--;
+  }
+  gpio_pin_wakeup_disable();
+  wifi_fpm_close();
+  WiFi.forceSleepBegin();                                 // back to modem forced sleep
+  *rxWoken = wisolLightSleepRxWoken || wisolTransport.available() > 0;
+
+  uint32_t sleptMs = (uint32_t)( ( ((uint64_t)(system_get_rtc_time() - rtcStart) * system_rtc_clock_cali_proc()) >> 12 ) / 1000 );
+  uint32_t savedNAh = ( sleptMs * (ENERGY_CPU_UA - ENERGY_LIGHTSLEEP_UA) ) / 3600;
+  WISOL_LOG_DEBUG(("Wisol light sleep %d ms, ~%d nAh saved\r\n",sleptMs,savedNAh));
+  return ( sleptMs > 0 )?sleptMs:1;
+}
+#endif
+
+/**
+ * Shorten a response wait to the time left before the deadline, 1 ms at least
+ */
+uint32_t WisolClass::clipWait(uint32_t maxMs) {
+  uint32_t left = getRemainingMs();
+  if ( left < maxMs ) return ( left > 0 )?left:1;
+  return maxMs;
+}
+
 void WisolClass::flushRxLine() {
-  while ( swSer1.available() ) swSer1.read(); 
+  while ( wisolTransport.available() ) wisolTransport.read(); 
 }
 
 void WisolClass::sendLine(const char * str) {
+  uint32_t d;
+  startLine(str);
+  while ( (d = txStep()) > 0 ) delay(d);
+}
+
+/**
+ * Prepare a line transmission, the chars are sent by txStep()
+ */
+void WisolClass::startLine(const char * str) {
   init();
-  int len = strlen(str);
-  if ( len > 1 ) {
-    for ( int i = 0 ; i < len-1 ; i++ ) {
-      swSer1.print(str[i]);
-      swSer1.flush();
-      delay(100);
+  txLine = str;
+  txPos = 0;
+}
+
+/**
+ * Send the next char of the line, paced according to the transport needs.
+ * Returns the delay before the next call or 0 when the line is sent
+ */
+uint32_t WisolClass::txStep() {
+  int len = strlen(txLine);
+  if ( txPos >= len ) return 0;
+  wisolTransport.write(txLine[txPos]);
+  txPos++;
+  if ( txPos < len ) {
+    uint32_t d = wisolTransport.charDelayMs();
+    if ( d > 0 ) {
+      wisolTransport.flush();
+      return d;
     }
-    swSer1.print(str[len-1]);
-  } else {
-    swSer1.print(str);
+    return txStep();
+  }
+  return 0;
+}
+
+/**
+ * Start a non blocking line reception with the given timeout
+ */
+void WisolClass::startRx(uint32_t maxMs) {
+  rxLen = 0;
+  rxDeadline = millis() + clipWait(maxMs);
+}
+
+/**
+ * Non blocking line reception, \r and \n are not copied. The line is in rxBuf
+ * Returns WISOL_RX_LINE when a line has been received, WISOL_RX_TIMEOUT once
+ * the deadline is passed, WISOL_RX_PENDING otherwise
+ */
+int WisolClass::rxStep() {
+  while ( wisolTransport.available() > 0 ) {
+    char c = wisolTransport.read();
+    if ( c == '\n' ) {
+      rxBuf[rxLen] = '\0';
+      rxLen = 0;
+      return WISOL_RX_LINE;
+    }
+    if ( c != '\r' && rxLen < WISOL_RX_LINE_SZ-1 ) rxBuf[rxLen++] = c;
   }
+  if ( (int32_t)(millis() - rxDeadline) >= 0 ) return WISOL_RX_TIMEOUT;
+  return WISOL_RX_PENDING;
 }
 
  /**
@@ -323,11 +746,15 @@ void WisolClass::sendLine(const char * str) {
    char * buf =_buf;
    bool end = false;
    char c;
+   maxMs = clipWait(maxMs);
    while ( true ) {
-     while ( !swSer1.available() && maxMs > 0 ) { delay(1); maxMs--; }
-     if ( maxMs == 0 ) return false;
-     while ( swSer1.available() > 0 && sz > 1) {
-        c=swSer1.read();
+     while ( !wisolTransport.available() && maxMs > 0 ) { delay(1); maxMs--; }
+     if ( maxMs == 0 ) {
+       countersService.inc(COUNTER_WISOL_TIMEOUT);
+       return false;
+     }
+     while ( wisolTransport.available() > 0 && sz > 1) {
+        c=wisolTransport.read();
         if ( withEol || (c != '\r' && c != '\n') ) {
           *buf=c;
           buf++;
@@ -339,6 +766,7 @@ void WisolClass::sendLine(const char * str) {
         //TTRACE2(("rTime : %d\r\n",maxMs ));
         if ( strncmp(_buf,"ERROR:",6) == 0 ) {
            WISOL_LOG_DEBUG(("Wisol serial err\r\n"));
+           countersService.inc(COUNTER_WISOL_ERROR);
            return false; 
         }
         return true;
@@ -23,6 +23,7 @@
  * ----------------------------------------------------------------------
  * Requires : SoftwareSerial - https://github.com/plerup/espsoftwareserial
  *                             /!\ version > 3.4.1 is recommanded
+ *            (when WISOL_TRANSPORT is WISOL_TRANSPORT_SWSERIAL)
  */
 
 
@@ -30,20 +31,74 @@
 #define WISOL_H_
 
 #include <Arduino.h>
+#include "config.h"
 #include "logger.h"
+#include "scheduler.h"
 
 #define WISOL_LOG_LEVEL 5                    // 5 - Debug | 4 - Info | 3 - Warn | 2 - Error | 1 - Any | 0 - None
 #define WISOL_WAIT_STD_TIME_MS   50          // Wait time in MS for wisol responding on standard short operation like config access
 #define WISOL_WAIT_UPLINK_MS   12000         // Wait time in MS for wisol responding on a frame transmition
+#define WISOL_WAIT_RESET_MS     1000         // Max wait time in MS for wisol being ready after reset
+#define WISOL_WAIT_WOKEN_MS      100         // Wait time in MS for the end of the uplink answer once it woke the ESP up
+#define WISOL_RX_POLL_MS           5         // Non blocking reception polling period
+#define WISOL_RX_LINE_SZ          32
+#if WISOL_TRANSPORT != WISOL_TRANSPORT_EMULATOR
+#define WISOL_LIGHT_SLEEP          1         // 1 - ESP in light sleep while waiting for the uplink response
+#else
+#define WISOL_LIGHT_SLEEP          0         // no RX pin activity with the emulator
+#endif
+#define WISOL_LIGHT_SLEEP_SLICE_MS 10
+
+#define WISOL_RX_PENDING           0
+#define WISOL_RX_LINE              1
+#define WISOL_RX_TIMEOUT           2
 
 
 #define WISOL_INVALID_TEMPERATURE     -300    
 #define WISOL_INVALID_VOLTAGE         0    
+#define WISOL_TEMPERATURE_MIN      -400       // 1/10 C, plausible range of the AT$T? answer
+#define WISOL_TEMPERATURE_MAX       850
+#define WISOL_VOLTAGE_MIN          1500       // mV, plausible range of the AT$V? answer
+#define WISOL_VOLTAGE_MAX          4500
 
 #define WISOL_STATUS_SEND_KO      0
 #define WISOL_STATUS_SEND_OK      1
 #define WISOL_STATUS_NO_DONWLINK  2
 #define WISOL_STATUS_DOWNLINK     3
+#define WISOL_STATUS_NOT_SENT     4         // uplink not started, the wake-up deadline has passed
+
+#define WISOL_POWER_VERSION        1         // RTC slot version of t_wisolPower
+#define WISOL_POWER_UNKNOWN        0         // state not known - cold boot or failed transition
+#define WISOL_POWER_SLEEPING       1
+#define WISOL_POWER_AWAKE          2
+#define WISOL_POWER_NEEDS_RESET    3         // module did not answer, reset on next wake-up
+
+typedef struct s_wisolPower {
+      uint8_t   state;          // module power state, valid across the ESP deep sleeps
+      uint8_t   failures;       // consecutive transitions without answer
+      uint16_t  day;            // day index of the counters
+      uint16_t  wakeUps;        // transitions done in the current day
+      uint16_t  sleeps;
+      uint16_t  resets;
+      uint16_t  skipped;        // redundant transitions avoided in the current day
+      uint16_t  prevDay;        // transitions done in the previous day
+      uint16_t  pad;
+} t_wisolPower;
+
+#define WISOL_QUERY_ID          0x01
+#define WISOL_QUERY_PAK         0x02
+#define WISOL_QUERY_TEMP        0x04
+#define WISOL_QUERY_VOLT        0x08
+#define WISOL_QUERY_FIELDS      4
+
+typedef struct s_wisolInfo {
+      uint8_t   requested;      // WISOL_QUERY_xx fields requested
+      uint8_t   valid;          // WISOL_QUERY_xx fields successfully read
+      uint32_t  sigfoxId;
+      char      pak[17];
+      int16_t   temperature;    // 1/10 C
+      uint16_t  voltage;        // mV
+} t_wisolInfo;
 
 class WisolClass {
 public:
@@ -56,6 +111,8 @@ public:
   bool getSigfoxPak(char * buf, int sz);
   bool getSigfoxPakWithRetry(char * buf, int sz, int retry);
 
+  bool query(t_wisolInfo * info, uint8_t fields, int retry);
+
   int16_t getTemperature();
   uint16_t getTemperatureWithRetry(int retry);
   uint16_t getVoltage();
@@ -65,7 +122,25 @@ public:
   void wakeUp();
   bool sleepMode(); 
   //bool isSleeping();
-  
+
+  // Power state tracking & AT sessions
+  void restorePowerState(uint16_t day);
+  void beginSession();
+  void endSession();
+  uint16_t getTransitionsToday();
+  uint8_t getPowerFailures();
+  uint32_t getUplinkMs();
+  uint32_t getUplinkSleptMs();
+  void printPowerStats();
+
+  // Wake-up time budget
+  void setDeadline(uint32_t awakeMs);
+  uint32_t getAwakeMs();
+  uint32_t getRemainingMs();
+
+  // Cooperative scheduler steps
+  static uint32_t wakeUpTask(void * ctx);
+  static uint32_t resetTask(void * ctx);
   
 protected:
   bool init();
@@ -73,6 +148,32 @@ protected:
   void sendLine(const char * str);
   void flushRxLine();
   bool ready = 0;
+
+  t_wisolPower power;
+  uint8_t sessionDepth = 0;
+  uint32_t uplinkMs = 0;                // uplink duration since the wake-up
+  uint32_t uplinkSleptMs = 0;           // part of it in light sleep
+  uint32_t deadlineMs = 0;              // getAwakeMs() limit of the waits, 0 when none
+  uint32_t clipWait(uint32_t maxMs);
+  void setPowerState(uint8_t state);
+  bool parseQuery(t_wisolInfo * info, uint8_t field, char * line);
+
+  uint8_t wakeUpStepIdx = 0;
+  uint8_t resetStepIdx = 0;
+  const char * txLine;              // line being transmitted char by char
+  uint8_t txPos;
+  char rxBuf[WISOL_RX_LINE_SZ];     // line being received in non blocking mode
+  uint8_t rxLen;
+  uint32_t rxDeadline;
+  uint32_t wakeUpStep();
+  uint32_t resetStep();
+  void startLine(const char * str);
+  uint32_t txStep();
+  void startRx(uint32_t maxMs);
+  int rxStep();
+  #if WISOL_LIGHT_SLEEP > 0
+  uint32_t waitRxLightSleep(uint32_t maxMs, bool * rxWoken);
+  #endif
   
 };
 
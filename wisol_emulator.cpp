@@ -0,0 +1,283 @@
+/* ======================================================================
+    This file is part of disk91_sigfox.
+
+    disk91_sigfox is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+*/
+/* ======================================================================
+ *  WISOL / Sigfox module / emulator
+ * ----------------------------------------------------------------------
+ * (c) Disk91 - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+
+#include "wisol_emulator.h"
+
+#if WISOL_TRANSPORT == WISOL_TRANSPORT_EMULATOR
+#include "wisol.h"
+#include "logger.h"
+ extern "C" {
+   #include <user_interface.h>
+ }
+
+WisolEmulatorTransport wisolEmulator;
+WisolTransport & wisolTransport = wisolEmulator;
+
+void WisolEmulatorTransport::begin() {
+  cmdLen = 0;
+  rxHead = 0;
+  rxLen = 0;
+  #if WISOL_EMU_LOSS_PCT > 0
+    seed ^= system_get_rtc_time();          // RAM is lost in deep sleep, vary the losses between wake-ups
+    setFault(WISOL_EMU_FAULT_SEND_KO,WISOL_EMU_LOSS_PCT);
+  #endif
+}
+
+/**
+ * Number of chars already received according to the timing model
+ */
+int WisolEmulatorTransport::available() {
+  uint32_t now = millis();
+  int n = 0;
+  while ( n < rxLen && (int32_t)(now - rxReadyAt[(rxHead + n) % WISOL_EMU_BUF_SZ]) >= 0 ) n++;
+  return n;
+}
+
+int WisolEmulatorTransport::read() {
+  if ( available() == 0 ) return -1;
+  char c = rx[rxHead];
+  rxHead = (rxHead + 1) % WISOL_EMU_BUF_SZ;
+  rxLen--;
+  return c;
+}
+
+/**
+ * The module processes a command on \r, a sleeping module ignores the chars
+ */
+void WisolEmulatorTransport::write(char c) {
+  bool pending = sleepPending;
+  sleepPending = false;
+  if ( c == '\n' && pending ) {
+    // module quirk : a LF right after AT$P=1 cancels the sleep request
+    sleeping = false;
+    return;
+  }
+  if ( sleeping ) return;
+  if ( c == '\r' ) {
+    cmd[cmdLen] = '\0';
+    execute();
+    cmdLen = 0;
+  } else if ( c != '\n' && cmdLen < WISOL_EMU_BUF_SZ-1 ) {
+    cmd[cmdLen++] = c;
+  }
+}
+
+void WisolEmulatorTransport::flush() {}
+
+/**
+ * A break wakes the module up
+ */
+void WisolEmulatorTransport::setBreak(bool active) {
+  sleepPending = false;
+  if ( ! active ) sleeping = false;
+}
+
+uint32_t WisolEmulatorTransport::charDelayMs() { return 0; }
+uint8_t WisolEmulatorTransport::rxPin() { return WISOL_RX_PIN; }
+const char * WisolEmulatorTransport::name() { return "emulator"; }
+
+// ==========================================================================
+// Emulation settings
+
+void WisolEmulatorTransport::setBaudRate(uint32_t baud) {
+  charUs = 10000000 / baud;                 // 8N1 - 10 bits per char
+}
+
+void WisolEmulatorTransport::setLatency(uint32_t stdMs, uint32_t uplinkMs, uint32_t resetMs) {
+  latencyStdMs = stdMs;
+  latencyUplinkMs = uplinkMs;
+  latencyResetMs = resetMs;
+}
+
+/**
+ * Inject the given fault on ratePct percent of the commands
+ */
+void WisolEmulatorTransport::setFault(uint8_t _fault, uint8_t ratePct) {
+  fault = _fault;
+  faultRate = ratePct;
+}
+
+bool WisolEmulatorTransport::isSleeping() {
+  return sleeping;
+}
+
+uint16_t WisolEmulatorTransport::getUplinks() {
+  return uplinks;
+}
+
+// ==========================================================================
+// Internal functions
+
+/**
+ * Execute the received command
+ */
+void WisolEmulatorTransport::execute() {
+  if ( faultNow(WISOL_EMU_FAULT_SILENT) ) return;
+  if ( faultNow(WISOL_EMU_FAULT_ERROR) ) { respond("ERROR: emulated",latencyStdMs); return; }
+
+  if ( strcmp(cmd,"AT$I=10") == 0 ) respond("0012ABCD",latencyStdMs);
+  else if ( strcmp(cmd,"AT$I=11") == 0 ) respond("0123456789ABCDEF",latencyStdMs);
+  else if ( strcmp(cmd,"AT$T?") == 0 ) respond("0250",latencyStdMs);
+  else if ( strcmp(cmd,"AT$V?") == 0 ) respond("3300",latencyStdMs);
+  else if ( strcmp(cmd,"AT$P=0") == 0 ) respond("OK",latencyResetMs);
+  else if ( strcmp(cmd,"AT$P=1") == 0 ) {
+    respond("OK",latencyStdMs);
+    if ( ! faultNow(WISOL_EMU_FAULT_NO_SLEEP) ) {
+      sleeping = true;
+      sleepPending = true;
+    }
+  }
+  else if ( strncmp(cmd,"AT$SF=",6) == 0 ) {
+    if ( faultNow(WISOL_EMU_FAULT_SEND_KO) ) {
+      respond("ERROR: send failed",latencyUplinkMs);
+    } else {
+      uplinks++;
+      respond("OK",latencyUplinkMs);
+    }
+  }
+  else respond("ERROR: parse error",latencyStdMs);
+}
+
+/**
+ * Queue an answer, the first char is received after the latency and the
+ * next ones according to the serial speed, after the previous answers
+ */
+void WisolEmulatorTransport::respond(const char * line, uint32_t latencyMs) {
+  uint32_t base = millis() + latencyMs;
+  if ( rxLen > 0 ) {
+    uint32_t last = rxReadyAt[(rxHead + rxLen - 1) % WISOL_EMU_BUF_SZ];
+    if ( (int32_t)(last - base) > 0 ) base = last;
+  }
+  int len = strlen(line);
+  int total = ( faultNow(WISOL_EMU_FAULT_TRUNCATED) )?len/2:len+2;
+  for ( int i = 0 ; i < total && rxLen < WISOL_EMU_BUF_SZ ; i++ ) {
+    uint8_t p = (rxHead + rxLen) % WISOL_EMU_BUF_SZ;
+    rx[p] = ( i < len )?line[i]:( (i == len)?'\r':'\n' );
+    rxReadyAt[p] = base + ((i+1) * charUs) / 1000;
+    rxLen++;
+  }
+}
+
+/**
+ * True when the given fault is active for the current command
+ */
+bool WisolEmulatorTransport::faultNow(uint8_t f) {
+  if ( fault != f || faultRate == 0 ) return false;
+  seed = seed * 1103515245 + 12345;                 // deterministic pseudo random
+  return ( ((seed >> 16) % 100) < faultRate );
+}
+
+// ==========================================================================
+// Benchmark
+
+#define WISOL_BENCH(name, call) {                                         \
+  uint32_t mn = 0xFFFFFFFF, mx = 0, sum = 0;                              \
+  for ( int i = 0 ; i < loops ; i++ ) {                                   \
+    uint32_t s = millis();                                                \
+    call;                                                                 \
+    uint32_t d = millis() - s;                                            \
+    if ( d < mn ) mn = d;                                                 \
+    if ( d > mx ) mx = d;                                                 \
+    sum += d;                                                             \
+  }                                                                       \
+  _log.any("| %-22s | %6d | %6d | %6d |\r\n",name,mn,sum/loops,mx);     \
+}
+
+/**
+ * Measure the end to end latency of the WisolClass public methods against the
+ * emulator, then run the methods with each fault injected to verify the
+ * error handling and the worst case latency.
+ */
+void WisolEmulatorTransport::runBenchmark(int loops) {
+  char pak[20];
+  uint8_t frame[12] = { 0 };
+  t_wisolInfo info;
+
+  _log.any("+------------------------+--------+--------+--------+\r\n");
+  _log.any("| method (%3d loops)     | min ms | avg ms | max ms |\r\n",loops);
+  _log.any("+------------------------+--------+--------+--------+\r\n");
+  WISOL_BENCH("reset",                wisolService.reset());
+  WISOL_BENCH("sleepMode+wakeUp",     { wisolService.sleepMode(); wisolService.wakeUp(); });
+  WISOL_BENCH("getSigfoxId",          wisolService.getSigfoxId());
+  WISOL_BENCH("getSigfoxPak",         wisolService.getSigfoxPak(pak,20));
+  WISOL_BENCH("getTemperature",       wisolService.getTemperature());
+  WISOL_BENCH("getVoltage",           wisolService.getVoltage());
+  WISOL_BENCH("query (4 fields)",     wisolService.query(&info,WISOL_QUERY_ID|WISOL_QUERY_PAK|WISOL_QUERY_TEMP|WISOL_QUERY_VOLT,1));
+  WISOL_BENCH("sendRaw",              wisolService.sendRaw(frame,12,false,NULL));
+  _log.any("+------------------------+--------+--------+--------+\r\n");
+
+  const char * faults[WISOL_EMU_FAULTS] = { "none", "error", "silent", "truncated", "no sleep", "send ko" };
+  for ( uint8_t f = WISOL_EMU_FAULT_NONE+1 ; f < WISOL_EMU_FAULTS ; f++ ) {
+    setFault(f,100);
+    uint32_t s = millis();
+    bool q = wisolService.query(&info,WISOL_QUERY_ID|WISOL_QUERY_PAK|WISOL_QUERY_TEMP|WISOL_QUERY_VOLT,1);
+    uint32_t qMs = millis() - s;
+    s = millis();
+    int r = wisolService.sendRaw(frame,12,false,NULL);
+    uint32_t rMs = millis() - s;
+    bool sl = wisolService.sleepMode();
+    _log.any("fault %-9s : query %s (%02X) %d ms, sendRaw %d %d ms, sleep %s/%s\r\n",faults[f],
+              (q)?"ok":"ko",info.valid,qMs,r,rMs,(sl)?"ok":"ko",(sleeping)?"asleep":"awake");
+    setFault(WISOL_EMU_FAULT_NONE,0);
+    wisolService.reset();
+  }
+  #if WISOL_EMU_LOSS_PCT > 0
+    setFault(WISOL_EMU_FAULT_SEND_KO,WISOL_EMU_LOSS_PCT);
+  #endif
+}
+
+/**
+ * Verify the wake-up deadline bounds the Wisol waits : a sequence of uplinks
+ * and a query is run with a slow module then with a silent module, it has
+ * to end WISOL_EMU_DEADLINE_MS after its start.
+ */
+void WisolEmulatorTransport::runDeadlineCheck() {
+  uint8_t frame[12] = { 0 };
+  t_wisolInfo info;
+  bool ok = true;
+
+  for ( int t = 0 ; t < 2 ; t++ ) {
+    if ( t == 0 ) setLatency(WISOL_EMU_LATENCY_STD_MS,3*WISOL_EMU_DEADLINE_MS,WISOL_EMU_LATENCY_RESET_MS);
+    else setFault(WISOL_EMU_FAULT_SILENT,100);
+    uint32_t s = wisolService.getAwakeMs();
+    wisolService.setDeadline(s + WISOL_EMU_DEADLINE_MS);
+    for ( int i = 0 ; i < 3 ; i++ ) wisolService.sendRaw(frame,12,false,NULL);
+    wisolService.query(&info,WISOL_QUERY_TEMP|WISOL_QUERY_VOLT,2);
+    uint32_t d = wisolService.getAwakeMs() - s;
+    bool pass = ( d <= WISOL_EMU_DEADLINE_MS + WISOL_EMU_DEADLINE_SLACK_MS );
+    _log.any("Deadline with %s module : %d ms for %d ms - %s\r\n",(t == 0)?"slow":"silent",d,WISOL_EMU_DEADLINE_MS,(pass)?"OK":"FAILED");
+    ok &= pass;
+    wisolService.setDeadline(0);
+    setLatency(WISOL_EMU_LATENCY_STD_MS,WISOL_EMU_LATENCY_UPLINK_MS,WISOL_EMU_LATENCY_RESET_MS);
+    setFault(WISOL_EMU_FAULT_NONE,0);
+    wisolService.reset();
+  }
+  #if WISOL_EMU_LOSS_PCT > 0
+    setFault(WISOL_EMU_FAULT_SEND_KO,WISOL_EMU_LOSS_PCT);
+  #endif
+  _log.any("Deadline check : %s\r\n",(ok)?"OK":"FAILED");
+}
+
+#endif
@@ -0,0 +1,104 @@
+/* ======================================================================
+    This file is part of disk91_sigfox.
+
+    disk91_sigfox is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+*/
+/* ======================================================================
+ *  WISOL / Sigfox module / emulator
+ * ----------------------------------------------------------------------
+ * (c) Disk91 - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ * In memory emulation of the WSSFM10R1 AT commands used by WisolClass
+ * (AT$P, AT$SF, AT$I=10/11, AT$T?, AT$V?) with a serial timing model,
+ * response latencies and fault injection. Selected as transport with
+ * WISOL_TRANSPORT_EMULATOR so WisolClass runs without the module.
+ */
+
+#ifndef WISOL_EMULATOR_H_
+#define WISOL_EMULATOR_H_
+
+#include <Arduino.h>
+#include "config.h"
+#include "wisol_transport.h"
+
+#define WISOL_EMU_BUF_SZ            128
+#define WISOL_EMU_DEFAULT_BAUD      9600
+#define WISOL_EMU_LATENCY_STD_MS    3         // module processing time of a short command
+#define WISOL_EMU_LATENCY_UPLINK_MS 6500      // uplink transmission time
+#define WISOL_EMU_LATENCY_RESET_MS  100       // software reset time
+
+#define WISOL_EMU_FAULT_NONE        0
+#define WISOL_EMU_FAULT_ERROR       1         // commands answered by ERROR:
+#define WISOL_EMU_FAULT_SILENT      2         // commands not answered
+#define WISOL_EMU_FAULT_TRUNCATED   3         // answers without end of line
+#define WISOL_EMU_FAULT_NO_SLEEP    4         // AT$P=1 acknowledged but the module stays awake
+#define WISOL_EMU_FAULT_SEND_KO     5         // uplink answered by ERROR:
+#define WISOL_EMU_FAULTS            6
+
+#define WISOL_EMU_LOSS_PCT          0         // uplink loss rate applied on start - exercises the uplink queue
+
+#define WISOL_EMU_DEADLINE_MS       3000      // deadline of runDeadlineCheck()
+#define WISOL_EMU_DEADLINE_SLACK_MS 150       // commands still sent after the deadline, without waiting for the answer
+
+class WisolEmulatorTransport : public WisolTransport {
+public:
+  void begin();
+  int  available();
+  int  read();
+  void write(char c);
+  void flush();
+  void setBreak(bool active);
+  uint32_t charDelayMs();
+  uint8_t rxPin();
+  const char * name();
+
+  // emulation settings
+  void setBaudRate(uint32_t baud);
+  void setLatency(uint32_t stdMs, uint32_t uplinkMs, uint32_t resetMs);
+  void setFault(uint8_t fault, uint8_t ratePct);
+  bool isSleeping();
+  uint16_t getUplinks();
+
+  void runBenchmark(int loops);
+  void runDeadlineCheck();
+
+protected:
+  char     cmd[WISOL_EMU_BUF_SZ];         // command being received
+  uint8_t  cmdLen;
+  char     rx[WISOL_EMU_BUF_SZ];          // answers waiting to be read
+  uint32_t rxReadyAt[WISOL_EMU_BUF_SZ];   // millis() when each char is received
+  uint8_t  rxHead;
+  uint8_t  rxLen;
+
+  uint32_t charUs = 10000000 / WISOL_EMU_DEFAULT_BAUD;
+  uint32_t latencyStdMs = WISOL_EMU_LATENCY_STD_MS;
+  uint32_t latencyUplinkMs = WISOL_EMU_LATENCY_UPLINK_MS;
+  uint32_t latencyResetMs = WISOL_EMU_LATENCY_RESET_MS;
+  uint8_t  fault = WISOL_EMU_FAULT_NONE;
+  uint8_t  faultRate = 0;
+  uint32_t seed = 0x1234567;
+  bool     sleeping = false;
+  bool     sleepPending = false;        // AT$P=1 just executed, the sleep can still be cancelled
+  uint16_t uplinks = 0;
+
+  void execute();
+  void respond(const char * line, uint32_t latencyMs);
+  bool faultNow(uint8_t f);
+};
+
+extern WisolEmulatorTransport wisolEmulator;
+
+#endif
@@ -0,0 +1,85 @@
+/* ======================================================================
+    This file is part of disk91_sigfox.
+
+    disk91_sigfox is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+*/
+/* ======================================================================
+ *  WISOL / Sigfox module / serial transport
+ * ----------------------------------------------------------------------
+ * (c) Disk91 - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ */
+
+#include "wisol_transport.h"
+
+#if WISOL_TRANSPORT == WISOL_TRANSPORT_SWSERIAL
+// ==========================================================================
+// SoftwareSerial - bit-banged in interrupts, the module needs the chars to
+// be paced to not loose some of them.
+
+static WisolSwSerialTransport swSerialTransport;
+WisolTransport & wisolTransport = swSerialTransport;
+
+WisolSwSerialTransport::WisolSwSerialTransport() : serial(WISOL_RX_PIN, WISOL_TX_PIN, false, 64) {   // RX, TX, Invert, Buffer Size
+}
+
+void WisolSwSerialTransport::begin() { serial.begin(WISOL_TRANSPORT_SPEED); }
+int  WisolSwSerialTransport::available() { return serial.available(); }
+int  WisolSwSerialTransport::read() { return serial.read(); }
+void WisolSwSerialTransport::write(char c) { serial.print(c); }
+void WisolSwSerialTransport::flush() { serial.flush(); }
+void WisolSwSerialTransport::setBreak(bool active) { digitalWrite(WISOL_TX_PIN,(active)?LOW:HIGH); }
+uint32_t WisolSwSerialTransport::charDelayMs() { return 100; }
+uint8_t WisolSwSerialTransport::rxPin() { return WISOL_RX_PIN; }
+const char * WisolSwSerialTransport::name() { return "swserial"; }
+
+#elif WISOL_TRANSPORT == WISOL_TRANSPORT_HWSERIAL
+// ==========================================================================
+// Hardware UART0 swapped on GPIO13/GPIO15, the transmission is done by the
+// UART FIFO so no pacing is needed. The debug traces are on Serial1.
+
+static WisolHwSerialTransport hwSerialTransport;
+WisolTransport & wisolTransport = hwSerialTransport;
+
+void WisolHwSerialTransport::begin() {
+  Serial.begin(WISOL_TRANSPORT_SPEED);
+  Serial.swap();
+}
+int  WisolHwSerialTransport::available() { return Serial.available(); }
+int  WisolHwSerialTransport::read() { return Serial.read(); }
+void WisolHwSerialTransport::write(char c) { Serial.write(c); }
+void WisolHwSerialTransport::flush() { Serial.flush(); }
+
+/**
+ * The UART can't hold the line low, the pin is released from the UART
+ * during the break.
+ */
+void WisolHwSerialTransport::setBreak(bool active) {
+  if ( active ) {
+    Serial.flush();
+    Serial.end();
+    pinMode(WISOL_HW_TX_PIN,OUTPUT);
+    digitalWrite(WISOL_HW_TX_PIN,LOW);
+  } else {
+    digitalWrite(WISOL_HW_TX_PIN,HIGH);
+    begin();
+  }
+}
+uint32_t WisolHwSerialTransport::charDelayMs() { return 0; }
+uint8_t WisolHwSerialTransport::rxPin() { return WISOL_HW_RX_PIN; }
+const char * WisolHwSerialTransport::name() { return "hwserial"; }
+
+#endif
@@ -0,0 +1,95 @@
+/* ======================================================================
+    This file is part of disk91_sigfox.
+
+    disk91_sigfox is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Foobar is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with Foobar.  If not, see <http://www.gnu.org/licenses/>.
+  =======================================================================
+*/
+/* ======================================================================
+ *  WISOL / Sigfox module / serial transport
+ * ----------------------------------------------------------------------
+ * (c) Disk91 - 2018
+ * Author : Paul Pinault aka disk91.com
+ * ----------------------------------------------------------------------
+ * The transport is selected at compile time with WISOL_TRANSPORT (config.h)
+ * - SoftwareSerial on WISOL_RX_PIN / WISOL_TX_PIN
+ * - Hardware UART0 swapped on GPIO13 (RX) / GPIO15 (TX), debug moves to Serial1
+ * - In memory emulator of the module, see wisol_emulator.h
+ */
+
+#ifndef WISOL_TRANSPORT_H_
+#define WISOL_TRANSPORT_H_
+
+#include <Arduino.h>
+#include "config.h"
+
+#define WISOL_TRANSPORT_SPEED     9600
+
+class WisolTransport {
+public:
+  virtual void begin() = 0;
+  virtual int  available() = 0;
+  virtual int  read() = 0;
+  virtual void write(char c) = 0;
+  virtual void flush() = 0;
+  virtual void setBreak(bool active) = 0;       // hold TX low for the wake-up break
+  virtual uint32_t charDelayMs() = 0;           // pacing needed between two chars
+  virtual uint8_t rxPin() = 0;                  // GPIO receiving the module responses
+  virtual const char * name() = 0;
+};
+
+#if WISOL_TRANSPORT == WISOL_TRANSPORT_SWSERIAL
+#include <SoftwareSerial.h>
+
+class WisolSwSerialTransport : public WisolTransport {
+public:
+  WisolSwSerialTransport();
+  void begin();
+  int  available();
+  int  read();
+  void write(char c);
+  void flush();
+  void setBreak(bool active);
+  uint32_t charDelayMs();
+  uint8_t rxPin();
+  const char * name();
+protected:
+  SoftwareSerial serial;
+};
+
+#elif WISOL_TRANSPORT == WISOL_TRANSPORT_HWSERIAL
+
+#define WISOL_HW_RX_PIN           13        // D7 once Serial is swapped
+#define WISOL_HW_TX_PIN           15        // D8 once Serial is swapped
+
+class WisolHwSerialTransport : public WisolTransport {
+public:
+  void begin();
+  int  available();
+  int  read();
+  void write(char c);
+  void flush();
+  void setBreak(bool active);
+  uint32_t charDelayMs();
+  uint8_t rxPin();
+  const char * name();
+};
+
+#elif WISOL_TRANSPORT == WISOL_TRANSPORT_EMULATOR
+#include "wisol_emulator.h"
+
+#endif
+
+extern WisolTransport & wisolTransport;
+
+#endif